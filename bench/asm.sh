@@ -0,0 +1,45 @@
+#!/bin/bash
+# Assembly throughput in MB/s of source: mipsscanner piped into mipsasm
+# against mipsasm reading the source file itself. Generates N blocks of
+# code (default 20000, about 5 MB) with labels, branches, loads and
+# comments, and checks that both paths write the same machine code and
+# symbol table. Tools come from $BIN (default: PATH).
+#   bench/asm.sh [blocks]
+set -e
+n=${1:-20000}
+bin=${BIN:+$BIN/}
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+
+awk -v n="$n" 'BEGIN {
+  for (k = 0; k < n; ++k) {
+    printf "L%d: ; block %d\n", k, k
+    printf "  lw $5, -12($29)       ; load a local\n"
+    printf "  add $3, $5, $6\n"
+    printf "  sub $30, $30, $4\n"
+    printf "  lis $28\n"
+    printf "  .word L%d\n", (k + 1) % n
+    printf "  slt $7, $3, $5\n"
+    printf "  beq $7, $0, L%d\n", k
+    printf "  bne $7, $0, M%d\n", k
+    printf "  mult $3, $5\n"
+    printf "  mflo $3\n"
+    printf "M%d: sw $3, 0x10($29)\n", k
+    printf "  .word -2147483648\n"
+    printf "  jalr $28\n"
+  }
+  printf "  jr $31\n"
+}' > "$dir/prog.asm"
+
+TIMEFORMAT=%R
+seconds() { { time "$@"; } 2>&1; }
+size=$(wc -c < "$dir/prog.asm")
+piped=$(seconds sh -c "${bin}mipsscanner < $dir/prog.asm | ${bin}mipsasm > $dir/piped.mips 2> $dir/piped.syms")
+fused=$(seconds sh -c "${bin}mipsasm $dir/prog.asm > $dir/fused.mips 2> $dir/fused.syms")
+cmp -s "$dir/piped.mips" "$dir/fused.mips" && cmp -s "$dir/piped.syms" "$dir/fused.syms" ||
+  { echo "outputs differ"; exit 1; }
+awk -v b="$size" -v p="$piped" -v f="$fused" 'BEGIN {
+  printf "%.1f MB of source\n", b / 1e6
+  printf "mipsscanner | mipsasm: %.2f s, %.1f MB/s\n", p, b / 1e6 / p
+  printf "mipsasm prog.asm:      %.2f s, %.1f MB/s\n", f, b / 1e6 / f
+}'
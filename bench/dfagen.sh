@@ -0,0 +1,68 @@
+#!/bin/bash
+# Direct-coded against table-driven scanning of the same input. Extracts the
+# WLP4 spec from wlp4scanner.cc, generates both scanners with dfagen -table,
+# and scans a large WLP4 source (bench/churn.wlp4 repeated, N copies,
+# default 2000) with each, checking that they produce the same tokens.
+# Needs g++; dfagen comes from $BIN (default: PATH).
+#   bench/dfagen.sh [copies]
+set -e
+copies=${1:-2000}
+bin=${BIN:+$BIN/}
+here=$(cd "$(dirname "$0")" && pwd)
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+
+sed -n '/^string DFAstring = R"(/,/^)";/p' "$here/../wlp4scanner.cc" | sed '1d;$d' > "$dir/wlp4.spec"
+${bin}dfagen -name wlp4 -table < "$dir/wlp4.spec" > "$dir/scanner.h"
+for ((k = 0; k < copies; ++k)); do cat "$here/churn.wlp4"; done > "$dir/input.wlp4"
+
+cat > "$dir/bench.cc" <<'EOF'
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include "scanner.h"
+using namespace std;
+
+struct Digest {
+  uint64_t tokens = 0, hash = 14695981039346656037ull;
+  void operator()(wlp4::Kind k, const char *, size_t len) {
+    ++tokens;
+    hash = (hash ^ (k * 131 + len)) * 1099511628211ull;
+  }
+};
+
+template<class F> double run(const string &text, Digest &d, F scan) {
+  auto start = chrono::steady_clock::now();
+  for (int r = 0; r < 5; ++r) {
+    d = Digest();
+    if (!scan(text.data(), text.size(), [&](wlp4::Kind k, const char *b, size_t n) { d(k, b, n); })) {
+      throw runtime_error("scan failed");
+    }
+  }
+  double secs = chrono::duration<double>(chrono::steady_clock::now() - start).count() / 5;
+  return text.size() / secs / 1e6;
+}
+
+int main(int argc, char *argv[]) {
+  ifstream in(argv[1], ios::binary);
+  stringstream ss;
+  ss << in.rdbuf();
+  string text = ss.str();
+  Digest direct, table;
+  double d = run(text, direct, [](const char *s, size_t n, auto f) { return wlp4::scan(s, n, f); });
+  double t = run(text, table, [](const char *s, size_t n, auto f) { return wlp4::scanTable(s, n, f); });
+  if (direct.tokens != table.tokens || direct.hash != table.hash) {
+    cerr << "ERROR: scanners disagree" << endl;
+    return 1;
+  }
+  cout << text.size() / 1000000.0 << " MB, " << direct.tokens << " tokens" << endl;
+  cout << "table-driven: " << t << " MB/s" << endl;
+  cout << "direct-coded: " << d << " MB/s" << endl;
+  return 0;
+}
+EOF
+g++ -std=c++17 -O2 -I"$dir" -o "$dir/bench" "$dir/bench.cc"
+"$dir/bench" "$dir/input.wlp4"
@@ -0,0 +1,100 @@
+#!/bin/bash
+# Link time for many MERL objects. Generates N modules (default 500), each
+# exporting one procedure that calls the next through an import, assembles
+# them with mipsasm -merl, links them with the WLP4 runtime and runs the
+# result. Then checks that a linked WLP4 program taking an array, where
+# mipssim places the array after the MERL footer, allocates its heap past
+# the array. Tools come from $BIN (default: PATH).
+#   bench/link.sh [objects]
+set -e
+n=${1:-500}
+bin=${BIN:+$BIN/}
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+
+module() {
+  local k=$1
+  echo ".export f$k"
+  if ((k + 1 < n)); then echo ".import f$((k + 1))"; fi
+  echo ".import print"
+  echo "f$k:"
+  for ((j = 0; j < 50; ++j)); do
+    echo "lis \$4"
+    echo ".word table$k"
+    echo "lw \$4, 0(\$4)"
+    echo "add \$3, \$3, \$4"
+  done
+  if ((k + 1 < n)); then
+    echo "sw \$31, -4(\$30)"
+    echo "lis \$31"
+    echo ".word 4"
+    echo "sub \$30, \$30, \$31"
+    echo "lis \$4"
+    echo ".word f$((k + 1))"
+    echo "jalr \$4"
+    echo "lis \$31"
+    echo ".word 4"
+    echo "add \$30, \$30, \$31"
+    echo "lw \$31, -4(\$30)"
+  fi
+  echo "jr \$31"
+  echo "table$k: .word 1"
+}
+
+{
+  echo ".import f0"
+  echo ".import print"
+  echo "sw \$31, -4(\$30)"
+  echo "lis \$31"
+  echo ".word 4"
+  echo "sub \$30, \$30, \$31"
+  echo "add \$3, \$0, \$0"
+  echo "lis \$4"
+  echo ".word f0"
+  echo "jalr \$4"
+  echo "add \$1, \$3, \$0"
+  echo "lis \$4"
+  echo ".word print"
+  echo "jalr \$4"
+  echo "lis \$31"
+  echo ".word 4"
+  echo "add \$30, \$30, \$31"
+  echo "lw \$31, -4(\$30)"
+  echo "jr \$31"
+} | ${bin}mipsscanner | ${bin}mipsasm -merl > "$dir/main.merl" 2> /dev/null
+objects=("$dir/main.merl")
+for ((k = 0; k < n; ++k)); do
+  module $k | ${bin}mipsscanner | ${bin}mipsasm -merl > "$dir/m$k.merl" 2> /dev/null
+  objects+=("$dir/m$k.merl")
+done
+${bin}wlp4gen -runtime | ${bin}mipsscanner | ${bin}mipsasm -merl > "$dir/runtime.merl" 2> /dev/null
+objects+=("$dir/runtime.merl")
+
+${bin}mipslink -stats "${objects[@]}" > "$dir/linked.merl" 2> "$dir/link.err"
+tail -1 "$dir/link.err"
+echo "expect $((50 * n)):"
+echo "0 0" | tr ' ' '\n' | ${bin}mipssim twoints "$dir/linked.merl" 2>/dev/null
+
+cat > "$dir/array.wlp4" <<'EOF'
+int wain(int* a, int b) {
+  int* p = NULL;
+  int i = 0;
+  p = new int[40];
+  *(p + 21) = 99;
+  while (i < b) {
+    println(*(a + i));
+    i = i + 1;
+  }
+  delete [] p;
+  return 0;
+}
+EOF
+${bin}wlp4scanner < "$dir/array.wlp4" | ${bin}wlp4parser | ${bin}wlp4gen -merl | ${bin}mipsscanner |
+  ${bin}mipsasm -merl > "$dir/array.merl" 2> /dev/null
+${bin}mipslink "$dir/array.merl" "$dir/runtime.merl" > "$dir/array.linked" 2> /dev/null
+if { echo 100; for ((k = 0; k < 100; ++k)); do echo 0; done; } |
+    ${bin}mipssim array "$dir/array.linked" 2> /dev/null | grep -qv '^0$'; then
+  echo "heap overlaps the array in a linked program"
+  exit 1
+fi
+echo "linked array program: ok"
@@ -0,0 +1,35 @@
+#!/bin/bash
+# Runs WLP4 programs (default bench/divtrap.wlp4) built by wlp4gen without
+# options, with -O and with -O -naive on the same twoints input (default 7
+# and -3), and fails if the printed output, $3 or an error differs from
+# the unoptimized build. Tools come from $BIN (default: PATH).
+#   bench/optcheck.sh [-input "a b"] [prog.wlp4...]
+set -e
+input="7 -3"
+if [ "$1" = "-input" ]; then input=$2; shift 2; fi
+here=$(cd "$(dirname "$0")" && pwd)
+[ $# -gt 0 ] || set -- "$here/divtrap.wlp4"
+bin=${BIN:+$BIN/}
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+
+run() {
+  ${bin}wlp4gen "$@" < "$dir/prog.tree" | ${bin}mipsscanner | ${bin}mipsasm > "$dir/prog.mips" 2> /dev/null
+  echo $input | tr ' ' '\n' | ${bin}mipssim twoints "$dir/prog.mips" 2> "$dir/err" || true
+  grep -o 'ERROR.*\|\$03 = [0-9a-fx]*' "$dir/err" || true
+}
+
+status=0
+for prog in "$@"; do
+  ${bin}wlp4scanner < "$prog" | ${bin}wlp4parser > "$dir/prog.tree"
+  expect=$(run)
+  same=1
+  for opts in "-O" "-O -naive"; do
+    if [ "$(run $opts)" != "$expect" ]; then
+      echo "$prog: wlp4gen $opts differs"
+      same=0 status=1
+    fi
+  done
+  [ $same -eq 0 ] || echo "$prog: ok"
+done
+exit $status
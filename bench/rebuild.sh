@@ -0,0 +1,54 @@
+#!/bin/bash
+# Rebuild time after a one-line edit, with and without the procedure cache
+# of wlp4parser and wlp4gen. Generates a program of N procedures (default
+# 300), builds it without the cache, builds it into an empty cache, then
+# changes one line of one procedure and rebuilds. Tools come from $BIN
+# (default: PATH).
+#   bench/rebuild.sh [procedures]
+set -e
+n=${1:-300}
+bin=${BIN:+$BIN/}
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+
+program() {
+  for ((k = 0; k < n; ++k)); do
+    echo "int p$k(int a, int* b) {"
+    echo "  int x = 0;"
+    echo "  int y = 1;"
+    echo "  int i = 0;"
+    echo "  while (i < a) {"
+    echo "    x = x + y * i;"
+    if ((k == n / 2)); then echo "    if (x > 1000) { x = x % $1; } else { y = y + *b; }"
+    else echo "    if (x > 1000) { x = x % 97; } else { y = y + *b; }"; fi
+    echo "    i = i + 1;"
+    echo "  }"
+    if ((k)); then echo "  return x + p$((k - 1))(a - 1, b);"; else echo "  return x;"; fi
+    echo "}"
+  done
+  echo "int wain(int a, int b) {"
+  echo "  return p$((n - 1))(a, &b);"
+  echo "}"
+}
+
+TIMEFORMAT=%R
+seconds() { { time "$@" > /dev/null 2>&1; } 2>&1; }
+
+build() {
+  local src=$1 cache=$2
+  local scan parse gen
+  scan=$(seconds sh -c "${bin}wlp4scanner < $src > $dir/tokens")
+  parse=$(seconds sh -c "${bin}wlp4parser $cache < $dir/tokens > $dir/tree")
+  gen=$(seconds sh -c "${bin}wlp4gen -O $cache < $dir/tree > $dir/out.asm")
+  echo "scan $scan s, parse $parse s, generate $gen s"
+}
+
+program 97 > "$dir/a.wlp4"
+program 89 > "$dir/b.wlp4"
+echo "$n procedures, $(wc -l < "$dir/a.wlp4") lines"
+echo "no cache, full build:  $(build "$dir/a.wlp4" "")"
+echo "no cache, after edit:  $(build "$dir/b.wlp4" "")"
+cp "$dir/out.asm" "$dir/ref.asm"
+echo "cache, cold build:     $(build "$dir/a.wlp4" "-cache $dir/cache")"
+echo "cache, after edit:     $(build "$dir/b.wlp4" "-cache $dir/cache")"
+cmp -s "$dir/out.asm" "$dir/ref.asm" || { echo "cached build differs"; exit 1; }
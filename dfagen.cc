@@ -0,0 +1,678 @@
+#include <iostream>
+#include <string>
+#include <vector>
+#include <utility>
+#include <sstream>
+#include <cstring>
+#include <array>
+#include <map>
+#include <unordered_map>
+using namespace std;
+
+// Reads a scanner spec in the .STATES/.TRANSITIONS format of wlp4scanner
+// and mipsscanner and writes a C++ header with a direct-coded scanner for
+// it: every state of the minimized DFA is a labelled block that tests the
+// next character with range compares, or a switch when there are more than
+// -compares ranges (default 4), and jumps to the next state's label. The
+// scanner calls back into the includer for every token, which takes the
+// place of the scanners' check_restrict. -table also emits the minimized
+// transition table and the loop that interprets it, for comparison.
+//   dfagen [-name namespace] [-table] [-compares n] < spec > scanner.h
+
+const string STATES      = ".STATES";
+const string TRANSITIONS = ".TRANSITIONS";
+const string INPUT       = ".INPUT";
+
+// States are numbered as the spec lists them while it is read. minimize()
+// then drops unreachable states, merges equivalent ones with Hopcroft's
+// algorithm and splits the characters into classes that every state treats
+// alike, so the scanning table is states x classes rather than states x 128.
+// Accepting states are never merged with each other: their names are the
+// token kinds.
+class DFA{
+    unordered_map<string, int> ids;
+    vector<string> names;
+    vector<bool> accepting;
+    vector<array<int, 128>> delta;  // as read, -1 for no transition
+    int classes = 0;
+    unsigned char classOf[256];
+    vector<int> table;              // state * classes + class, -1 for none
+
+    vector<int> characterClasses(const vector<array<int, 128>> &d, int &count);
+
+    public:
+    int initial = 0;
+    int specStates = 0;
+    bool getAccept(int s) const { return accepting[s]; }
+    const string &name(int s) const { return names[s]; }
+    int size() const { return names.size(); }
+    int classCount() const { return classes; }
+    int characterClass(unsigned char c) const { return classOf[c]; }
+    int classTransition(int s, int k) const { return table[s * classes + k]; }
+    int state(const string &s) const {
+      auto it = ids.find(s);
+      if (it == ids.end()) throw runtime_error("Invalid state!");
+      return it->second;
+    }
+    void addState(string s, bool accept){
+      if (!ids.emplace(s, names.size()).second) throw runtime_error("Duplicate state " + s);
+      names.push_back(s);
+      accepting.push_back(accept);
+      array<int, 128> none;
+      none.fill(-1);
+      delta.push_back(none);
+    }
+    // The first transition listed for a state and character wins.
+    void addTransition(int s1, char c, int s2){
+      int &t = delta[s1][(unsigned char)c];
+      if (t < 0) t = s2;
+    }
+    void minimize();
+    int getNextState(int s, char c) const {
+      return table[s * classes + classOf[(unsigned char)c]];
+    }
+};
+
+// Classes of characters with identical columns in d; returns each
+// character's class (characters above 127 have no transitions).
+vector<int> DFA::characterClasses(const vector<array<int, 128>> &d, int &count) {
+  map<vector<int>, int> columns;
+  vector<int> cls(256);
+  vector<int> column(d.size());
+  for (int c = 0; c < 256; ++c) {
+    for (size_t s = 0; s < d.size(); ++s) column[s] = c < 128 ? d[s][c] : -1;
+    cls[c] = columns.emplace(column, columns.size()).first->second;
+  }
+  count = columns.size();
+  return cls;
+}
+
+void DFA::minimize() {
+  specStates = names.size();
+  // Reachable states, renumbered in breadth-first order from the start.
+  vector<int> order(1, initial), renumber(names.size(), -1);
+  renumber[initial] = 0;
+  for (size_t i = 0; i < order.size(); ++i) {
+    for (int t : delta[order[i]]) {
+      if (t >= 0 && renumber[t] < 0) {
+        renumber[t] = order.size();
+        order.push_back(t);
+      }
+    }
+  }
+  int n = order.size();
+  int dead = n;  // stands for every missing transition
+  int k;
+  vector<int> cls = characterClasses(delta, k);
+  vector<int> rep(k);
+  for (int c = 127; c >= 0; --c) rep[cls[c]] = c;
+  // next[s * k + a] over states 0..n, the dead state included.
+  vector<int> next((n + 1) * k, dead);
+  for (int s = 0; s < n; ++s) {
+    for (int a = 0; a < k; ++a) {
+      int t = rep[a] < 128 ? delta[order[s]][rep[a]] : -1;
+      if (t >= 0) next[s * k + a] = renumber[t];
+    }
+  }
+  // Predecessors by class, as offsets into one array.
+  vector<int> predStart((n + 1) * k + 1, 0), pred((n + 1) * k);
+  for (int s = 0; s <= n; ++s) {
+    for (int a = 0; a < k; ++a) ++predStart[next[s * k + a] * k + a + 1];
+  }
+  for (size_t i = 1; i < predStart.size(); ++i) predStart[i] += predStart[i - 1];
+  {
+    vector<int> fill(predStart.begin(), predStart.end() - 1);
+    for (int s = 0; s <= n; ++s) {
+      for (int a = 0; a < k; ++a) pred[fill[next[s * k + a] * k + a]++] = s;
+    }
+  }
+  // Refinable partition: block b holds elems[first[b] .. end[b]), the
+  // marked ones at the front.
+  vector<int> elems(n + 1), loc(n + 1), blockOf(n + 1);
+  vector<int> first, end, marked;
+  int pos = 0;
+  auto newBlock = [&](const vector<int> &members) {
+    int b = first.size();
+    first.push_back(pos);
+    for (int s : members) {
+      elems[pos] = s;
+      loc[s] = pos++;
+      blockOf[s] = b;
+    }
+    end.push_back(pos);
+    marked.push_back(0);
+  };
+  // The dead state starts in a block of its own: a rejecting state that
+  // still has transitions keeps consuming input under maximal munch, even
+  // if it can never reach acceptance, so it must not become missing.
+  vector<int> rejecting;
+  for (int s = 0; s < n; ++s) if (!accepting[order[s]]) rejecting.push_back(s);
+  newBlock(rejecting);
+  newBlock(vector<int>(1, dead));
+  for (int s = 0; s < n; ++s) if (accepting[order[s]]) newBlock(vector<int>(1, s));
+  // Worklist of (block, class) splitters.
+  vector<char> waiting((n + 1) * k, 0);
+  vector<pair<int, int>> work;
+  for (int b = 1; b < (int)first.size(); ++b) {
+    for (int a = 0; a < k; ++a) {
+      waiting[b * k + a] = 1;
+      work.push_back(make_pair(b, a));
+    }
+  }
+  vector<int> touched, splitter;
+  while (!work.empty()) {
+    int b = work.back().first, a = work.back().second;
+    work.pop_back();
+    waiting[b * k + a] = 0;
+    splitter.assign(elems.begin() + first[b], elems.begin() + end[b]);
+    for (int t : splitter) {
+      for (int i = predStart[t * k + a]; i < predStart[t * k + a + 1]; ++i) {
+        int s = pred[i], y = blockOf[s];
+        int j = first[y] + marked[y];
+        if (loc[s] < j) continue;  // already marked
+        if (marked[y]++ == 0) touched.push_back(y);
+        int other = elems[j];
+        swap(elems[loc[s]], elems[j]);
+        loc[other] = loc[s];
+        loc[s] = j;
+      }
+    }
+    for (int y : touched) {
+      int m = marked[y];
+      marked[y] = 0;
+      if (m == end[y] - first[y]) continue;
+      // The marked front of y becomes a new block.
+      int z = first.size();
+      first.push_back(first[y]);
+      end.push_back(first[y] + m);
+      marked.push_back(0);
+      first[y] += m;
+      for (int i = first[z]; i < end[z]; ++i) blockOf[elems[i]] = z;
+      for (int c = 0; c < k; ++c) {
+        if (waiting[y * k + c] || m <= end[y] - first[y]) {
+          waiting[z * k + c] = 1;
+          work.push_back(make_pair(z, c));
+        } else {
+          waiting[y * k + c] = 1;
+          work.push_back(make_pair(y, c));
+        }
+      }
+    }
+    touched.clear();
+  }
+  // One state per block but the dead state's, numbered from the start.
+  int blocks = first.size();
+  vector<int> number(blocks, -1), members;
+  number[blockOf[0]] = 0;
+  members.push_back(0);
+  for (size_t i = 0; i < members.size(); ++i) {
+    for (int a = 0; a < k; ++a) {
+      int t = next[members[i] * k + a], b = blockOf[t];
+      if (b != blockOf[dead] && number[b] < 0) {
+        number[b] = members.size();
+        members.push_back(t);
+      }
+    }
+  }
+  vector<string> minNames;
+  vector<bool> minAccepting;
+  vector<array<int, 128>> minDelta(members.size());
+  for (size_t i = 0; i < members.size(); ++i) {
+    int s = members[i];
+    minNames.push_back(names[order[s]]);
+    minAccepting.push_back(accepting[order[s]]);
+    for (int c = 0; c < 128; ++c) {
+      int b = blockOf[next[s * k + cls[c]]];
+      minDelta[i][c] = b == blockOf[dead] ? -1 : number[b];
+    }
+  }
+  names.swap(minNames);
+  accepting.swap(minAccepting);
+  ids.clear();
+  initial = 0;
+  // Merged states may now treat more characters alike.
+  cls = characterClasses(minDelta, classes);
+  for (int c = 0; c < 256; ++c) classOf[c] = cls[c];
+  table.assign(names.size() * classes, -1);
+  for (size_t s = 0; s < names.size(); ++s) {
+    for (int c = 0; c < 128; ++c) table[s * classes + classOf[c]] = minDelta[s][c];
+  }
+  delta.clear();
+}
+
+//Helper Functions
+
+bool isChar(string s) {
+  return s.length() == 1;
+}
+
+bool isRange(string s) {
+  return s.length() == 3 && s[1] == '-';
+}
+
+string squish(string s) {
+  stringstream ss(s);
+  string token;
+  string result;
+  string space = "";
+  while(ss >> token) {
+    result += space;
+    result += token;
+    space = " ";
+  }
+  return result;
+}
+
+int hexToNum(char c) {
+  if ('0' <= c && c <= '9') {
+    return c - '0';
+  } else if ('a' <= c && c <= 'f') {
+    return 10 + (c - 'a');
+  } else if ('A' <= c && c <= 'F') {
+    return 10 + (c - 'A');
+  }
+  // This should never happen....
+  throw runtime_error("Invalid hex digit!");
+}
+
+char numToHex(int d) {
+  return (d < 10 ? d + '0' : d - 10 + 'A');
+}
+
+string escape(string s) {
+  string p;
+  for(size_t i=0; i<s.length(); ++i) {
+    if (s[i] == '\\' && i+1 < s.length()) {
+      char c = s[i+1]; 
+      i = i+1;
+      if (c == 's') {
+        p += ' ';            
+      } else
+      if (c == 'n') {
+        p += '\n';            
+      } else
+      if (c == 'r') {
+        p += '\r';            
+      } else
+      if (c == 't') {
+        p += '\t';            
+      } else
+      if (c == 'x') {
+        if(i+2 < s.length() && isxdigit(s[i+1]) && isxdigit(s[i+2])) {
+          if (hexToNum(s[i+1]) > 8) {
+            throw runtime_error(
+                "Invalid escape sequence \\x"
+                + string(1, s[i+1])
+                + string(1, s[i+2])
+                +": not in ASCII range (0x00 to 0x7F)");
+          }
+          char code = hexToNum(s[i+1])*16 + hexToNum(s[i+2]);
+          p += code;
+          i = i+2;
+        } else {
+          p += c;
+        }
+      } else
+      if (isgraph(c)) {
+        p += c;            
+      } else {
+        p += s[i];
+      }
+    } else {
+       p += s[i];
+    }
+  }  
+  return p;
+}
+
+string unescape(string s) {
+  string p;
+  for(size_t i=0; i<s.length(); ++i) {
+    char c = s[i];
+    if (c == ' ') {
+      p += "\\s";
+    } else
+    if (c == '\n') {
+      p += "\\n";
+    } else
+    if (c == '\r') {
+      p += "\\r";
+    } else
+    if (c == '\t') {
+      p += "\\t";
+    } else
+    if (!isgraph(c)) {
+      string hex = "\\x";
+      p += hex + numToHex((unsigned char)c/16) + numToHex((unsigned char)c%16);
+    } else {
+      p += c;
+    }
+  }
+  return p;
+}
+DFA DFAconstruct(istream &in) { 
+  DFA dfa;
+  string s;
+  while(true) {
+    if (!(getline(in, s))) {
+      throw runtime_error
+        ("Expected " + STATES + ", but found end of input.");
+    }
+    s = squish(s);
+    if (s == STATES) {
+      break;
+    }
+    if (!s.empty()) {
+      throw runtime_error
+        ("Expected " + STATES + ", but found: " + s);
+    }
+  }
+  // Get states
+  bool first = true;
+  while(true) {
+    if (!(in >> s)) {
+      throw runtime_error
+        ("Unexpected end of input while reading state set: " 
+         + TRANSITIONS + "not found.");
+    }
+    if (s == TRANSITIONS) {
+      break;
+    } 
+    // Process an individual state
+    bool accepting = false;
+    if (s.back() == '!' && s.length() > 1) {
+      accepting = true;
+      s.pop_back();
+    }
+
+    dfa.addState(s, accepting);
+    if (first) dfa.initial = dfa.size() - 1;
+    first = false;
+  }
+  // Get transitions
+  getline(in, s); // Skip .TRANSITIONS header
+  while(true) {
+    if (!(getline(in, s))) {
+      break;
+    }
+    s = squish(s);
+    if (s == INPUT) {
+      break;
+    } 
+    string lineStr = s;
+    stringstream line(lineStr);
+    vector<string> lineVec;
+    while(line >> s) {
+      lineVec.push_back(s);
+    }
+    if(lineVec.empty()) {
+      continue;
+    }
+    if (lineVec.size() < 3) {
+      throw runtime_error
+        ("Incomplete transition line: " + lineStr);
+    }
+    // Extract state information from the line
+    int fromState = dfa.state(lineVec.front());
+    int toState = dfa.state(lineVec.back());
+    // Extract character and range information from the line
+    for(size_t i = 1; i + 1 < lineVec.size(); ++i) {
+      string charOrRange = escape(lineVec[i]);
+      if (isChar(charOrRange)) {
+        char c = charOrRange[0];
+        if ((unsigned char)c > 127) {
+          throw runtime_error
+            ("Invalid (non-ASCII) character in transition line: " + lineStr + "\n"
+             + "Character " + unescape(string(1,c)) + " is outside ASCII range");
+        }
+        dfa.addTransition(fromState, c, toState);
+      } else if (isRange(charOrRange)) {
+        int lo = (unsigned char)charOrRange[0], hi = (unsigned char)charOrRange[2];
+        if (lo > 127 || hi > 127) {
+          throw runtime_error
+            ("Invalid (non-ASCII) range in transition line: " + lineStr);
+        }
+        for(int c = lo; c <= hi; ++c) {
+          dfa.addTransition(fromState, c, toState);
+        }
+      } else {
+        throw runtime_error
+          ("Expected character or range, but found "
+           + charOrRange + " in transition line: " + lineStr);
+      }
+    }
+  }
+  dfa.minimize();
+  return dfa;
+}
+// ---- Code generation ----
+
+// Enumerator names for the accepting states: the state name without
+// characters that cannot appear in an identifier ("?WHITESPACE" becomes
+// WHITESPACE), made unique.
+vector<string> kindIdentifiers(const vector<string> &names) {
+  vector<string> ids;
+  unordered_map<string, int> used;
+  for (const string &n : names) {
+    string id;
+    for (char c : n) if (isalnum((unsigned char)c) || c == '_') id += c;
+    if (id.empty() || isdigit((unsigned char)id[0])) id = "K" + id;
+    string base = id;
+    for (int k = 2; used.count(id); ++k) id = base + to_string(k);
+    used[id] = 1;
+    ids.push_back(id);
+  }
+  return ids;
+}
+
+string charLiteral(int c) {
+  if (c == '\'' || c == '\\') return string("'\\") + (char)c + "'";
+  if (isgraph(c) || c == ' ') return "'" + string(1, (char)c) + "'";
+  return to_string(c);
+}
+
+string cString(const string &s) {
+  string r = "\"";
+  for (char c : s) {
+    if (c == '"' || c == '\\') r += '\\';
+    r += c;
+  }
+  return r + "\"";
+}
+
+class Generator {
+    const DFA &dfa;
+    string name;
+    ostream &out;
+    vector<int> kindOf;  // state -> kind, -1 for non-accepting
+    vector<string> kinds;
+    int maxCompares;
+
+    // Runs of characters from state s that go to the same state, in
+    // character order.
+    struct Range { int lo, hi, target; };
+    vector<Range> ranges(int s) {
+      vector<Range> r;
+      for (int c = 0; c < 128; ++c) {
+        int t = dfa.getNextState(s, c);
+        if (t < 0) continue;
+        if (!r.empty() && r.back().hi == c - 1 && r.back().target == t) r.back().hi = c;
+        else r.push_back({c, c, t});
+      }
+      return r;
+    }
+    void header();
+    void state(int s);
+    void table();
+
+    public:
+    Generator(const DFA &d, const string &n, ostream &o, int compares) : dfa(d), name(n), out(o), maxCompares(compares) {}
+    void generate(bool withTable);
+};
+
+void Generator::header() {
+  vector<string> names;
+  kindOf.assign(dfa.size(), -1);
+  for (int s = 0; s < dfa.size(); ++s) {
+    if (!dfa.getAccept(s)) continue;
+    kindOf[s] = names.size();
+    names.push_back(dfa.name(s));
+  }
+  kinds = kindIdentifiers(names);
+  out << "// Generated by dfagen: a direct-coded maximal-munch scanner, " << dfa.size() << " states.\n"
+      << "// Do not edit; regenerate from the spec instead.\n"
+      << "#include <cstddef>\n\n"
+      << "namespace " << name << " {\n\n"
+      << "enum Kind {";
+  for (size_t k = 0; k < kinds.size(); ++k) out << (k ? ", " : " ") << kinds[k];
+  out << " };\n\n"
+      << "// The state names from the spec, by kind.\n"
+      << "const char *const kindName[] = {";
+  for (size_t k = 0; k < names.size(); ++k) out << (k ? ", " : " ") << cString(names[k]);
+  out << " };\n\n";
+}
+
+// One labelled block per state: take a transition on the next character,
+// or finish the token (accepting states) or fail.
+void Generator::state(int s) {
+  out << " s" << s << ":  // " << dfa.name(s) << "\n";
+  bool accepting = kindOf[s] >= 0;
+  if (accepting) {
+    out << "  if (p == end) {\n"
+        << "    accept(" << kinds[kindOf[s]] << ", start, p - start);\n"
+        << "    return true;\n"
+        << "  }\n";
+  } else if (s == dfa.initial) {
+    out << "  if (p == end) return true;\n";
+  } else {
+    out << "  if (p == end) goto fail;\n";
+  }
+  vector<Range> r = ranges(s);
+  if (!r.empty()) out << "  c = (unsigned char)*p;\n";
+  if ((int)r.size() <= maxCompares) {
+    for (const Range &g : r) {
+      if (g.lo == g.hi) out << "  if (c == " << charLiteral(g.lo) << ")";
+      else if (g.lo == 0) out << "  if (c <= " << charLiteral(g.hi) << ")";  // c is unsigned
+      else out << "  if (c >= " << charLiteral(g.lo) << " && c <= " << charLiteral(g.hi) << ")";
+      out << " { ++p; goto s" << g.target << "; }\n";
+    }
+  } else {
+    // Cases grouped by target state.
+    map<int, vector<int>> byTarget;
+    for (const Range &g : r) {
+      for (int c = g.lo; c <= g.hi; ++c) byTarget[g.target].push_back(c);
+    }
+    out << "  switch (c) {\n";
+    for (auto &t : byTarget) {
+      out << "   ";
+      int col = 3;
+      for (int c : t.second) {
+        string l = " case " + charLiteral(c) + ":";
+        if (col + l.size() > 96) {
+          out << "\n   ";
+          col = 3;
+        }
+        out << l;
+        col += l.size();
+      }
+      out << "\n      ++p; goto s" << t.first << ";\n";
+    }
+    out << "  }\n";
+  }
+  if (!accepting) {
+    out << "  goto fail;\n";
+    return;
+  }
+  if (s == dfa.initial) out << "  if (p == start) goto fail;\n";
+  out << "  accept(" << kinds[kindOf[s]] << ", start, p - start);\n"
+      << "  start = p;\n"
+      << "  goto s" << dfa.initial << ";\n";
+}
+
+// The minimized table and an interpreter over it with the same contract as
+// scan(), as the scanners run it.
+void Generator::table() {
+  int classes = dfa.classCount();
+  out << "const unsigned char classOf[256] = {";
+  for (int c = 0; c < 256; ++c) out << (c % 32 ? " " : "\n  ") << (int)dfa.characterClass(c) << ",";
+  out << "\n};\n\n"
+      << "const short next[" << dfa.size() << "][" << classes << "] = {\n";
+  for (int s = 0; s < dfa.size(); ++s) {
+    out << "  {";
+    for (int k = 0; k < classes; ++k) out << (k ? ", " : "") << dfa.classTransition(s, k);
+    out << "},\n";
+  }
+  out << "};\n\n"
+      << "// Kind of each state, -1 for non-accepting.\n"
+      << "const short kindOf[" << dfa.size() << "] = {";
+  for (int s = 0; s < dfa.size(); ++s) out << (s ? ", " : " ") << kindOf[s];
+  out << " };\n\n"
+      << "template<class Accept>\n"
+      << "bool scanTable(const char *s, size_t n, Accept accept, size_t *stop = nullptr) {\n"
+      << "  const char *p = s, *end = s + n, *start = s;\n"
+      << "  int state = " << dfa.initial << ";\n"
+      << "  while (p != end) {\n"
+      << "    int t = next[state][classOf[(unsigned char)*p]];\n"
+      << "    if (t >= 0) {\n"
+      << "      state = t;\n"
+      << "      ++p;\n"
+      << "    } else if (kindOf[state] >= 0 && p > start) {\n"
+      << "      accept((Kind)kindOf[state], start, p - start);\n"
+      << "      state = " << dfa.initial << ";\n"
+      << "      start = p;\n"
+      << "    } else {\n"
+      << "      if (stop) *stop = p - s;\n"
+      << "      return false;\n"
+      << "    }\n"
+      << "  }\n"
+      << "  if (kindOf[state] >= 0) accept((Kind)kindOf[state], start, p - start);\n"
+      << "  else if (p != start) {\n"
+      << "    if (stop) *stop = p - s;\n"
+      << "    return false;\n"
+      << "  }\n"
+      << "  return true;\n"
+      << "}\n\n";
+}
+
+void Generator::generate(bool withTable) {
+  header();
+  out << "// Splits s[0, n) into maximal-munch tokens, calling\n"
+      << "// accept(Kind, const char *begin, size_t length) for each; accept may\n"
+      << "// throw to reject a token. Returns false, with the offset of the\n"
+      << "// offending character (n at end of input) in *stop, if the input\n"
+      << "// cannot be split.\n"
+      << "template<class Accept>\n"
+      << "bool scan(const char *s, size_t n, Accept accept, size_t *stop = nullptr) {\n"
+      << "  const char *p = s, *end = s + n, *start = s;\n"
+      << "  unsigned char c;\n"
+      << "  goto s" << dfa.initial << ";\n";
+  for (int s = 0; s < dfa.size(); ++s) state(s);
+  out << " fail:\n"
+      << "  if (stop) *stop = p - s;\n"
+      << "  return false;\n"
+      << "}\n\n";
+  if (withTable) table();
+  out << "}  // namespace " << name << "\n";
+}
+
+int main(int argc, char *argv[]) {
+  try {
+    string name = "scanner";
+    bool withTable = false;
+    int compares = 4;
+    for (int i = 1; i < argc; ++i) {
+      string a = argv[i];
+      bool hasArg = i + 1 < argc;
+      if (a == "-name" && hasArg) name = argv[++i];
+      else if (a == "-table") withTable = true;
+      else if (a == "-compares" && hasArg) compares = stoi(argv[++i]);
+      else throw runtime_error("usage: dfagen [-name namespace] [-table] [-compares n] < spec > scanner.h");
+    }
+    DFA dfa = DFAconstruct(cin);
+    Generator(dfa, name, cout, compares).generate(withTable);
+  } catch(runtime_error &e) {
+    cerr << "ERROR: " << e.what() << "\n";
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,543 @@
+#include <iostream>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <utility>
+#include <sstream>
+#include <cstring>
+#include <cstdint>
+#include <chrono>
+#include <algorithm>
+#include <unordered_map>
+#include <unordered_set>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+using namespace std;
+
+// Reads the token stream written by mipsscanner ("KIND lexeme" per line,
+// NEWLINE after every source line), writes big-endian machine code to
+// stdout and the symbol table ("label address") to stderr.
+//
+// Given a source file instead (mipsasm prog.asm), it maps the file and
+// scans it itself, with the same tokens and checks as mipsscanner except
+// that blank lines and CRLF line endings are accepted, where mipsscanner
+// rejects them. Each line's tokens are collected as spans of the mapped
+// text in a small buffer and encoded straight away, so no token is ever
+// copied into a string. Either way the assembler makes one pass, and patches uses of
+// labels not yet defined at the end.
+//
+// With -merl the output is a relocatable MERL object instead:
+//   0x10000002 (beq $0, $0, 2), file length, end of code   header, 3 words
+//   code, assembled as if loaded at address 0 (so it starts at 0xc)
+//   footer: 0x01 addr                   REL, .word label at addr
+//           0x11 addr len c1 .. clen    ESR, .word of imported label at addr
+//           0x05 addr len c1 .. clen    ESD, label exported from this file
+// where addr is a file offset and names take one word per character.
+// ".import label" and ".export label" name the symbols that cross files;
+// both take no space in the code. Loaded at address 0, a fully linked
+// object runs as is, since the header branches over itself.
+
+// INT and INTORID only appear in patterns.
+enum Kind { ID, LABELDEF, DOTID, DECINT, HEXINT, REGISTER, COMMA, LPAREN, RPAREN, NEWLINE, OTHER,
+            INT, INTORID };
+
+class Token {
+  public:
+  Kind kind;
+  string_view lexeme;  // into the input, which outlives the assembler
+};
+
+Kind kindNamed(string_view k) {
+  static const unordered_map<string_view, Kind> kinds = {
+    {"ID", ID}, {"LABELDEF", LABELDEF}, {"DOTID", DOTID}, {"DECINT", DECINT}, {"HEXINT", HEXINT},
+    {"REGISTER", REGISTER}, {"COMMA", COMMA}, {"LPAREN", LPAREN}, {"RPAREN", RPAREN}, {"NEWLINE", NEWLINE}
+  };
+  auto it = kinds.find(k);
+  return it == kinds.end() ? OTHER : it->second;
+}
+
+const uint32_t MERL_COOKIE = 0x10000002;
+enum MerlRecord { REL = 0x01, ESD = 0x05, ESR = 0x11 };
+
+enum Op { ADD, SUB, SLT, SLTU, MULT, MULTU, DIV, DIVU, MFHI, MFLO, LIS, LW, SW, BEQ, BNE, JR, JALR };
+
+class Assembler {
+    bool merl;
+    unordered_map<string_view, uint32_t> symbols;
+    vector<pair<string_view, uint32_t>> order;  // symbol table in definition order
+    unordered_set<string_view> imports;
+    vector<string_view> exports;
+    vector<uint32_t> relocations;                  // addresses holding a label address
+    vector<pair<uint32_t, string_view>> externals;  // addresses holding an import
+    // A use of a label that was not defined yet, patched by finish().
+    struct Fixup {
+      size_t word;
+      string_view label;
+      int line;
+      bool branch;
+    };
+    vector<Fixup> fixups;
+    vector<uint32_t> words;
+    uint32_t pc;
+    int lineNo = 1;
+
+    void fail(const string &msg) {
+      throw runtime_error("line " + to_string(lineNo) + ": " + msg);
+    }
+    // Checks that toks matches a pattern of token kinds.
+    bool matches(const vector<Token> &toks, initializer_list<Kind> kinds) {
+      if (toks.size() != kinds.size()) return false;
+      size_t i = 0;
+      for (Kind k : kinds) {
+        Kind t = toks[i++].kind;
+        if (k == INT) {
+          if (t != DECINT && t != HEXINT) return false;
+        } else if (k == INTORID) {
+          if (t != DECINT && t != HEXINT && t != ID) return false;
+        } else if (t != k) {
+          return false;
+        }
+      }
+      return true;
+    }
+    int64_t toNumber(const Token &t) {
+      string_view s = t.lexeme;
+      bool negative = false;
+      int base = 10;
+      if (t.kind == HEXINT && s.size() > 2) {
+        s.remove_prefix(2);
+        base = 16;
+      } else if (!s.empty() && s[0] == '-') {
+        s.remove_prefix(1);
+        negative = true;
+      }
+      if (s.empty() || s.size() > 16) fail("number out of range: " + string(t.lexeme));
+      int64_t v = 0;
+      for (char c : s) {
+        int d = isdigit((unsigned char)c) ? c - '0' : base == 16 && isxdigit((unsigned char)c) ? tolower(c) - 'a' + 10 : -1;
+        if (d < 0) fail("bad number " + string(t.lexeme));
+        v = v * base + d;
+      }
+      return negative ? -v : v;
+    }
+    int regNumber(const Token &t) {
+      int r = 0;
+      for (char c : t.lexeme.substr(1)) r = r * 10 + (c - '0');
+      return r;
+    }
+    // Branch offset from the instruction at address at to label address to.
+    uint32_t branchOffset(uint32_t to, uint32_t at, string_view label) {
+      int64_t v = ((int64_t)to - (at + 4)) / 4;
+      if (v < -32768 || v > 32767) fail("immediate out of range: " + string(label));
+      return v & 0xffff;
+    }
+    uint32_t immediate16(const Token &t, bool branch) {
+      if (t.kind == ID) {
+        if (!branch) fail("label not allowed here");
+        if (imports.count(t.lexeme)) fail("cannot branch to imported label " + string(t.lexeme));
+        auto it = symbols.find(t.lexeme);
+        if (it != symbols.end()) return branchOffset(it->second, pc, t.lexeme);
+        fixups.push_back({words.size(), t.lexeme, lineNo, true});
+        return 0;
+      }
+      int64_t v = toNumber(t);
+      if (t.kind == HEXINT) {
+        if (v > 0xffff) fail("immediate out of range: " + string(t.lexeme));
+        return v;
+      }
+      if (v < -32768 || v > 32767) fail("immediate out of range: " + string(t.lexeme));
+      return v & 0xffff;
+    }
+    uint32_t wordOf(const Token &t) {
+      if (t.kind == ID) {
+        if (imports.count(t.lexeme)) {
+          externals.push_back(make_pair(pc, t.lexeme));
+          return 0;
+        }
+        auto it = symbols.find(t.lexeme);
+        if (it == symbols.end()) {
+          fixups.push_back({words.size(), t.lexeme, lineNo, false});
+          return 0;
+        }
+        if (merl) relocations.push_back(pc);
+        return it->second;
+      }
+      int64_t v = toNumber(t);
+      if (v < INT32_MIN || v > UINT32_MAX) fail("value out of range: " + string(t.lexeme));
+      return (uint32_t)v;
+    }
+    void directive(const vector<Token> &t);
+
+    public:
+    Assembler(bool merl) : merl(merl), pc(merl ? 12 : 0) {}
+    void setLine(int n) { lineNo = n; }
+    void label(string_view name);
+    void instruction(const vector<Token> &t);
+    void finish();
+    void write(ostream &out);
+    void writeSymbols(ostream &out);
+};
+
+void Assembler::label(string_view name) {
+  if (!symbols.emplace(name, pc).second) fail("duplicate label " + string(name));
+  order.push_back(make_pair(name, pc));
+}
+
+// .word, .import and .export; the last two take no space.
+void Assembler::directive(const vector<Token> &t) {
+  string_view op = t[0].lexeme;
+  if (op == ".import" || op == ".export") {
+    if (!merl) fail(string(op) + " needs -merl");
+    if (!matches(t, {DOTID, ID})) fail("bad " + string(op));
+    if (op == ".import") imports.insert(t[1].lexeme);
+    else exports.push_back(t[1].lexeme);
+    return;
+  }
+  if (op != ".word") fail("expected instruction, found " + string(op));
+  if (!matches(t, {DOTID, INTORID})) fail("bad .word");
+  words.push_back(wordOf(t[1]));
+  pc += 4;
+}
+
+// Encodes one line's tokens, without its label definitions.
+void Assembler::instruction(const vector<Token> &t) {
+  static const unordered_map<string_view, Op> ops = {
+    {"add", ADD}, {"sub", SUB}, {"slt", SLT}, {"sltu", SLTU}, {"mult", MULT}, {"multu", MULTU},
+    {"div", DIV}, {"divu", DIVU}, {"mfhi", MFHI}, {"mflo", MFLO}, {"lis", LIS}, {"lw", LW},
+    {"sw", SW}, {"beq", BEQ}, {"bne", BNE}, {"jr", JR}, {"jalr", JALR}
+  };
+  if (t.empty()) return;
+  if (t[0].kind == DOTID) {
+    directive(t);
+    return;
+  }
+  string op(t[0].lexeme);
+  if (t[0].kind != ID) fail("expected instruction, found " + op);
+  auto it = ops.find(t[0].lexeme);
+  if (it == ops.end()) fail("unknown instruction " + op);
+  uint32_t w = 0;
+  switch (it->second) {
+    case ADD: case SUB: case SLT: case SLTU: {
+      if (!matches(t, {ID, REGISTER, COMMA, REGISTER, COMMA, REGISTER})) fail("bad " + op);
+      Op o = it->second;
+      uint32_t funct = o == ADD ? 0x20 : o == SUB ? 0x22 : o == SLT ? 0x2a : 0x2b;
+      w = regNumber(t[3]) << 21 | regNumber(t[5]) << 16 | regNumber(t[1]) << 11 | funct;
+      break;
+    }
+    case MULT: case MULTU: case DIV: case DIVU: {
+      if (!matches(t, {ID, REGISTER, COMMA, REGISTER})) fail("bad " + op);
+      Op o = it->second;
+      uint32_t funct = o == MULT ? 0x18 : o == MULTU ? 0x19 : o == DIV ? 0x1a : 0x1b;
+      w = regNumber(t[1]) << 21 | regNumber(t[3]) << 16 | funct;
+      break;
+    }
+    case MFHI: case MFLO: case LIS: {
+      if (!matches(t, {ID, REGISTER})) fail("bad " + op);
+      uint32_t funct = it->second == MFHI ? 0x10 : it->second == MFLO ? 0x12 : 0x14;
+      w = regNumber(t[1]) << 11 | funct;
+      break;
+    }
+    case LW: case SW: {
+      if (!matches(t, {ID, REGISTER, COMMA, INT, LPAREN, REGISTER, RPAREN})) fail("bad " + op);
+      uint32_t opc = it->second == LW ? 0x23 : 0x2b;
+      w = opc << 26 | regNumber(t[5]) << 21 | regNumber(t[1]) << 16 | immediate16(t[3], false);
+      break;
+    }
+    case BEQ: case BNE: {
+      if (!matches(t, {ID, REGISTER, COMMA, REGISTER, COMMA, INTORID})) fail("bad " + op);
+      uint32_t opc = it->second == BEQ ? 0x04 : 0x05;
+      w = opc << 26 | regNumber(t[1]) << 21 | regNumber(t[3]) << 16 | immediate16(t[5], true);
+      break;
+    }
+    case JR: case JALR: {
+      if (!matches(t, {ID, REGISTER})) fail("bad " + op);
+      w = regNumber(t[1]) << 21 | (it->second == JR ? 0x08 : 0x09);
+      break;
+    }
+  }
+  words.push_back(w);
+  pc += 4;
+}
+
+// Checks the .import/.export lists and patches uses of labels that were
+// defined after them.
+void Assembler::finish() {
+  for (string_view name : imports) {
+    if (symbols.count(name)) throw runtime_error("imported label " + string(name) + " is also defined");
+  }
+  for (string_view name : exports) {
+    if (!symbols.count(name)) throw runtime_error("exported label " + string(name) + " is not defined");
+  }
+  uint32_t start = merl ? 12 : 0;
+  for (const Fixup &f : fixups) {
+    lineNo = f.line;
+    uint32_t at = start + 4 * f.word;
+    if (imports.count(f.label)) {
+      if (f.branch) fail("cannot branch to imported label " + string(f.label));
+      externals.push_back(make_pair(at, f.label));
+      continue;
+    }
+    auto it = symbols.find(f.label);
+    if (it == symbols.end()) fail("undefined label " + string(f.label));
+    if (f.branch) {
+      words[f.word] |= branchOffset(it->second, at, f.label);
+    } else {
+      words[f.word] = it->second;
+      if (merl) relocations.push_back(at);
+    }
+  }
+  sort(relocations.begin(), relocations.end());
+  sort(externals.begin(), externals.end());
+}
+
+// Feeds the "KIND lexeme" lines of text to a.
+void assembleTokens(string_view text, Assembler &a) {
+  vector<Token> toks;
+  int line = 1;
+  bool labelsDone = false;
+  size_t pos = 0;
+  while (pos < text.size()) {
+    size_t eol = text.find('\n', pos);
+    if (eol == string_view::npos) eol = text.size();
+    string_view s = text.substr(pos, eol - pos);
+    pos = eol + 1;
+    // Split into kind and lexeme at whitespace.
+    auto skip = [&](bool space) {
+      size_t i = 0;
+      while (i < s.size() && (isspace((unsigned char)s[i]) != 0) == space) ++i;
+      return i;
+    };
+    s.remove_prefix(skip(true));
+    if (s.empty()) continue;
+    string_view kind = s.substr(0, skip(false));
+    s.remove_prefix(kind.size());
+    s.remove_prefix(skip(true));
+    string_view lexeme = s.substr(0, skip(false));
+    Kind k = kindNamed(kind);
+    a.setLine(line);
+    if (k == NEWLINE) {
+      a.instruction(toks);
+      toks.clear();
+      labelsDone = false;
+      ++line;
+    } else if (k == LABELDEF) {
+      if (labelsDone) throw runtime_error("line " + to_string(line) + ": label after instruction");
+      lexeme.remove_suffix(1);
+      a.label(lexeme);
+    } else {
+      toks.push_back({k, lexeme});
+      labelsDone = true;
+    }
+  }
+  a.setLine(line);
+  a.instruction(toks);
+}
+
+// Scans assembly source the way mipsscanner does and feeds each line's
+// tokens to a. A line may end in \r\n.
+void assembleSource(string_view text, Assembler &a) {
+  vector<Token> toks;
+  int line = 1;
+  size_t pos = 0;
+  while (pos <= text.size()) {
+    size_t eol = text.find('\n', pos);
+    if (eol == string_view::npos) {
+      if (pos == text.size()) break;
+      eol = text.size();
+    }
+    const char *p = text.data() + pos, *end = text.data() + eol;
+    if (end > p && end[-1] == '\r') --end;
+    pos = eol + 1;
+    auto fail = [&](const char *at, const string &msg) {
+      if (msg.empty()) {
+        throw runtime_error("line " + to_string(line) + ": " +
+                            (at == end ? "end of input not accepted" : "invalid transition state"));
+      }
+      throw runtime_error("line " + to_string(line) + ": " + msg);
+    };
+    auto digits = [&](const char *q) {
+      while (q < end && isdigit((unsigned char)*q)) ++q;
+      return q;
+    };
+    a.setLine(line);
+    toks.clear();
+    while (p < end) {
+      const char *start = p;
+      unsigned char c = *p;
+      Kind k;
+      if (c == ' ' || c == '\t') {
+        ++p;
+        continue;
+      } else if (c == ';') {
+        // Comments take any ASCII character but \n and \r.
+        while (p < end && *p != '\r' && (unsigned char)*p < 0x80) ++p;
+        continue;
+      } else if (isalpha(c)) {
+        while (p < end && isalnum((unsigned char)*p)) ++p;
+        k = ID;
+        if (p < end && *p == ':') {
+          if (!toks.empty()) fail(p, "label after instruction");
+          a.label(string_view(start, p - start));
+          ++p;
+          continue;
+        }
+      } else if (c == '.') {
+        if (++p == end || !isalpha((unsigned char)*p)) fail(p, "");
+        while (p < end && isalnum((unsigned char)*p)) ++p;
+        k = DOTID;
+      } else if (c == '0' && p + 1 < end && p[1] == 'x') {
+        p += 2;
+        if (p == end || !isxdigit((unsigned char)*p)) fail(p, "");
+        while (p < end && isxdigit((unsigned char)*p)) ++p;
+        if (p - start > 10) fail(p, "hexint out of range");
+        k = HEXINT;
+      } else if (isdigit(c) || c == '-') {
+        if (c == '-' && (++p == end || !isdigit((unsigned char)*p))) fail(p, "");
+        p = digits(p);
+        int64_t v = 0, max = c == '-' ? 2147483648LL : 4294967295LL;
+        for (const char *q = start + (c == '-'); q < p; ++q) {
+          v = v * 10 + (*q - '0');
+          if (v > max) fail(p, "decint out of range");
+        }
+        k = DECINT;
+      } else if (c == '$') {
+        if (++p == end || !isdigit((unsigned char)*p)) fail(p, "");
+        p = digits(p);
+        if (p - start > 3 || (p - start == 3 && (start[1] - '0') * 10 + (start[2] - '0') > 31)) {
+          fail(p, "register out of range");
+        }
+        k = REGISTER;
+      } else if (c == ',') {
+        ++p;
+        k = COMMA;
+      } else if (c == '(') {
+        ++p;
+        k = LPAREN;
+      } else if (c == ')') {
+        ++p;
+        k = RPAREN;
+      } else {
+        fail(p, "");
+      }
+      toks.push_back({k, string_view(start, p - start)});
+    }
+    a.instruction(toks);
+    ++line;
+  }
+}
+
+class MappedFile {
+  public:
+    const char *data = nullptr;
+    size_t size = 0;
+    MappedFile(const string &path) {
+      int fd = open(path.c_str(), O_RDONLY);
+      if (fd < 0) throw runtime_error("cannot open " + path);
+      struct stat st;
+      if (fstat(fd, &st) < 0) {
+        close(fd);
+        throw runtime_error("cannot stat " + path);
+      }
+      size = st.st_size;
+      if (size > 0) {
+        void *p = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (p == MAP_FAILED) throw runtime_error("cannot map " + path);
+        data = (const char *)p;
+      } else {
+        close(fd);
+      }
+    }
+    ~MappedFile() { if (data) munmap((void *)data, size); }
+    MappedFile(const MappedFile &) = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
+};
+
+void putName(vector<uint32_t> &footer, string_view name) {
+  footer.push_back(name.size());
+  for (unsigned char c : name) footer.push_back(c);
+}
+
+void Assembler::write(ostream &out) {
+  vector<uint32_t> footer;
+  if (merl) {
+    for (uint32_t a : relocations) {
+      footer.push_back(REL);
+      footer.push_back(a);
+    }
+    for (auto &e : externals) {
+      footer.push_back(ESR);
+      footer.push_back(e.first);
+      putName(footer, e.second);
+    }
+    for (string_view name : exports) {
+      footer.push_back(ESD);
+      footer.push_back(symbols[name]);
+      putName(footer, name);
+    }
+  }
+  // Built whole and written at once.
+  vector<uint32_t> all;
+  if (merl) {
+    uint32_t codeEnd = 12 + 4 * words.size();
+    all = {MERL_COOKIE, codeEnd + 4 * (uint32_t)footer.size(), codeEnd};
+  }
+  all.insert(all.end(), words.begin(), words.end());
+  all.insert(all.end(), footer.begin(), footer.end());
+  string bytes(4 * all.size(), '\0');
+  for (size_t i = 0; i < all.size(); ++i) {
+    uint32_t w = all[i];
+    bytes[4 * i] = w >> 24; bytes[4 * i + 1] = w >> 16; bytes[4 * i + 2] = w >> 8; bytes[4 * i + 3] = w;
+  }
+  out.write(bytes.data(), bytes.size());
+}
+
+void Assembler::writeSymbols(ostream &out) {
+  for (auto &s : order) out << s.first << " " << s.second << "\n";
+}
+
+int main(int argc, char *argv[]) {
+  try {
+    bool merl = false;
+    bool stats = false;
+    string source;
+    for (int i = 1; i < argc; ++i) {
+      string a = argv[i];
+      if (a == "-merl") merl = true;
+      else if (a == "-stats") stats = true;
+      else if (a[0] != '-' && source.empty()) source = a;
+      else throw runtime_error("usage: mipsasm [-merl] [-stats] < tokens\n       mipsasm [-merl] [-stats] prog.asm");
+    }
+    auto start = chrono::steady_clock::now();
+    Assembler a(merl);
+    size_t bytes;
+    if (source.empty()) {
+      stringstream ss;
+      ss << cin.rdbuf();
+      string text = ss.str();
+      bytes = text.size();
+      assembleTokens(text, a);
+      a.finish();
+      a.write(cout);
+      a.writeSymbols(cerr);
+    } else {
+      MappedFile f(source);
+      bytes = f.size;
+      assembleSource(string_view(f.data, f.size), a);
+      a.finish();
+      a.write(cout);
+      a.writeSymbols(cerr);
+    }
+    if (stats) {
+      double secs = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+      cerr << bytes << " bytes of " << (source.empty() ? "tokens" : "source") << " in " << secs * 1000 << " ms ("
+           << (secs > 0 ? bytes / secs / 1e6 : 0) << " MB/s)" << endl;
+    }
+  } catch(runtime_error &e) {
+    cerr << "ERROR: " << e.what() << "\n";
+    return 1;
+  }
+  return 0;
+}
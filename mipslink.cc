@@ -0,0 +1,237 @@
+#include <iostream>
+#include <string>
+#include <vector>
+#include <utility>
+#include <cstring>
+#include <cstdint>
+#include <chrono>
+#include <unordered_map>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+using namespace std;
+
+// Links MERL objects written by mipsasm -merl into one MERL file on stdout,
+// laid out in command-line order, and writes the exported symbols
+// ("label address") to stderr. Every .import must be exported by exactly
+// one object; the result keeps its REL and ESD entries, so it can be linked
+// again, and runs as is when loaded at address 0.
+//
+// Inputs are mapped, not read. One pass over the footers places every
+// object and enters its exports in a single hash table; a second pass
+// copies each object's code into place and patches it in footer order.
+
+const uint32_t MERL_COOKIE = 0x10000002;
+enum MerlRecord { REL = 0x01, ESD = 0x05, ESR = 0x11 };
+
+uint32_t getWord(const unsigned char *p) {
+  return (uint32_t)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+void setWord(unsigned char *p, uint32_t w) {
+  p[0] = w >> 24; p[1] = w >> 16; p[2] = w >> 8; p[3] = w;
+}
+
+class MappedFile {
+  public:
+    const unsigned char *data = nullptr;
+    size_t size = 0;
+    MappedFile(const string &path) {
+      int fd = open(path.c_str(), O_RDONLY);
+      if (fd < 0) throw runtime_error("cannot open " + path);
+      struct stat st;
+      if (fstat(fd, &st) < 0) {
+        close(fd);
+        throw runtime_error("cannot stat " + path);
+      }
+      size = st.st_size;
+      if (size > 0) {
+        void *p = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (p == MAP_FAILED) throw runtime_error("cannot map " + path);
+        data = (const unsigned char *)p;
+      } else {
+        close(fd);
+      }
+    }
+    ~MappedFile() { if (data) munmap((void *)data, size); }
+    MappedFile(const MappedFile &) = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
+};
+
+class Object {
+  public:
+    string path;
+    MappedFile file;
+    uint32_t codeEnd;
+    uint32_t base;  // where this object's address 0xc lands in the output
+    Object(const string &p) : path(p), file(p) {}
+
+    uint32_t word(uint32_t offset) const { return getWord(file.data + offset); }
+    void fail(const string &msg) const { throw runtime_error(path + ": " + msg); }
+
+    void checkHeader() {
+      if (file.size < 12 || file.size % 4 || word(0) != MERL_COOKIE) fail("not a MERL file");
+      codeEnd = word(8);
+      if (word(4) != file.size || codeEnd < 12 || codeEnd > file.size || codeEnd % 4) {
+        fail("bad MERL header");
+      }
+    }
+    // Calls f(type, address, name offset, name length) for each footer entry;
+    // names are left in the file, one character per word.
+    template<class F> void footer(F f) const {
+      uint32_t i = codeEnd;
+      while (i < file.size) {
+        if (i + 8 > file.size) fail("truncated footer");
+        uint32_t type = word(i), addr = word(i + 4);
+        // REL and ESR patch a word of the code; an export may also name
+        // the end of the code.
+        uint32_t limit = type == ESD ? codeEnd + 4 : codeEnd;
+        if (addr < 12 || addr >= limit || addr % 4) fail("footer address out of range");
+        i += 8;
+        uint32_t len = 0;
+        if (type == ESR || type == ESD) {
+          if (i + 4 > file.size) fail("truncated footer");
+          len = word(i);
+          i += 4;
+          if (len == 0 || len > (file.size - i) / 4) fail("bad symbol name");
+        } else if (type != REL) {
+          fail("unknown footer entry " + to_string(type));
+        }
+        f(type, addr, i, len);
+        i += 4 * len;
+      }
+    }
+    string name(uint32_t offset, uint32_t len) const {
+      string s(len, ' ');
+      for (uint32_t k = 0; k < len; ++k) s[k] = file.data[offset + 4 * k + 3];
+      return s;
+    }
+};
+
+class Linker {
+    vector<Object*> objects;
+    // Exported name -> (address in the output, defining object).
+    unordered_map<string, pair<uint32_t, size_t>> symbols;
+    vector<pair<string, uint32_t>> order;  // exports in link order
+    vector<unsigned char> image;
+    vector<uint32_t> footer;
+    size_t relocations = 0;
+    size_t imports = 0;
+
+    public:
+    ~Linker() { for (Object *o : objects) delete o; }
+    void add(const string &path) { objects.push_back(new Object(path)); }
+    void link();
+    void write(ostream &out);
+    void writeSymbols(ostream &out);
+    void report(ostream &out, double secs);
+};
+
+void Linker::link() {
+  // Pass 1: place the objects and collect their exports.
+  uint32_t end = 12;
+  size_t entries = 0;
+  for (size_t i = 0; i < objects.size(); ++i) {
+    Object &o = *objects[i];
+    o.checkHeader();
+    o.base = end;
+    if ((uint64_t)end + o.codeEnd - 12 > UINT32_MAX) o.fail("output too large");
+    end += o.codeEnd - 12;
+    o.footer([&](uint32_t type, uint32_t addr, uint32_t at, uint32_t len) {
+      ++entries;
+      if (type != ESD) return;
+      string name = o.name(at, len);
+      uint32_t a = addr - 12 + o.base;
+      auto ins = symbols.emplace(name, make_pair(a, i));
+      if (!ins.second) {
+        o.fail("duplicate export " + name + " (also in " + objects[ins.first->second.second]->path + ")");
+      }
+      order.push_back(make_pair(name, a));
+    });
+  }
+  // Pass 2: copy the code and apply REL and ESR entries in one sweep each.
+  image.resize(end);
+  setWord(&image[0], MERL_COOKIE);
+  footer.reserve(2 * entries);
+  string name;
+  for (Object *op : objects) {
+    Object &o = *op;
+    unsigned char *code = &image[o.base];
+    memcpy(code, o.file.data + 12, o.codeEnd - 12);
+    uint32_t delta = o.base - 12;
+    o.footer([&](uint32_t type, uint32_t addr, uint32_t at, uint32_t len) {
+      unsigned char *p = code + (addr - 12);
+      if (type == REL) {
+        setWord(p, getWord(p) + delta);
+        ++relocations;
+      } else if (type == ESR) {
+        name = o.name(at, len);
+        auto it = symbols.find(name);
+        if (it == symbols.end()) o.fail("undefined symbol " + name);
+        setWord(p, it->second.first);
+        ++imports;
+      } else {
+        return;  // exports are written from the symbol table
+      }
+      footer.push_back(REL);
+      footer.push_back(addr + delta);
+    });
+  }
+  for (auto &s : order) {
+    footer.push_back(ESD);
+    footer.push_back(s.second);
+    footer.push_back(s.first.size());
+    for (unsigned char c : s.first) footer.push_back(c);
+  }
+  setWord(&image[4], end + 4 * footer.size());
+  setWord(&image[8], end);
+}
+
+void Linker::write(ostream &out) {
+  size_t n = image.size();
+  image.resize(n + 4 * footer.size());
+  for (uint32_t w : footer) {
+    setWord(&image[n], w);
+    n += 4;
+  }
+  out.write((const char *)image.data(), image.size());
+}
+
+void Linker::writeSymbols(ostream &out) {
+  for (auto &s : order) out << s.first << " " << s.second << "\n";
+}
+
+void Linker::report(ostream &out, double secs) {
+  out << objects.size() << " objects, " << image.size() << " bytes, " << symbols.size() << " exports, "
+      << imports << " imports, " << relocations << " relocations in " << secs * 1000 << " ms" << endl;
+}
+
+int main(int argc, char *argv[]) {
+  try {
+    bool stats = false;
+    Linker linker;
+    int inputs = 0;
+    for (int i = 1; i < argc; ++i) {
+      string a = argv[i];
+      if (a == "-stats") stats = true;
+      else if (a[0] == '-') throw runtime_error("usage: mipslink [-stats] object.merl... > linked.merl");
+      else {
+        linker.add(a);
+        ++inputs;
+      }
+    }
+    if (inputs == 0) throw runtime_error("usage: mipslink [-stats] object.merl... > linked.merl");
+    auto start = chrono::steady_clock::now();
+    linker.link();
+    double secs = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    linker.write(cout);
+    linker.writeSymbols(cerr);
+    if (stats) linker.report(cerr, secs);
+  } catch(runtime_error &e) {
+    cerr << "ERROR: " << e.what() << "\n";
+    return 1;
+  }
+  return 0;
+}
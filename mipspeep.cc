@@ -0,0 +1,349 @@
+#include <iostream>
+#include <string>
+#include <vector>
+#include <utility>
+#include <sstream>
+#include <cstdint>
+#include <algorithm>
+using namespace std;
+
+// Peephole optimizer for MIPS assembly. Reads the token stream written by
+// mipsscanner and writes an equivalent, shorter token stream in the same
+// format, so it fits between mipsscanner and mipsasm:
+//   mipsscanner < prog.asm | mipspeep | mipsasm > prog.mips
+// Rewrites come from a table of patterns that are matched over a sliding
+// window of instructions until none applies; the number of rewrites per
+// pattern is reported on stderr. Control is assumed to enter code only
+// at labels and at the targets of numeric branch offsets.
+
+class Token {
+  public:
+  string kind;
+  string lexeme;
+  Token(string k, string l) : kind(k), lexeme(l) {}
+};
+
+class Line {
+  public:
+  vector<string> labels;   // as written, with the trailing colon
+  vector<Token> tokens;    // empty once the line has been deleted
+};
+
+vector<Line> readLines(istream &in) {
+  vector<Line> lines;
+  Line cur;
+  string s;
+  while (getline(in, s)) {
+    istringstream ss(s);
+    string kind, lexeme;
+    if (!(ss >> kind)) continue;
+    ss >> lexeme;
+    if (kind == "NEWLINE") {
+      lines.push_back(cur);
+      cur = Line();
+    } else if (kind == "LABELDEF") {
+      cur.labels.push_back(lexeme);
+    } else {
+      cur.tokens.push_back(Token(kind, lexeme));
+    }
+  }
+  if (!cur.labels.empty() || !cur.tokens.empty()) lines.push_back(cur);
+  return lines;
+}
+
+void writeLines(ostream &out, const vector<Line> &lines) {
+  for (const Line &l : lines) {
+    if (l.labels.empty() && l.tokens.empty()) continue;
+    for (const string &label : l.labels) out << "LABELDEF " << label << "\n";
+    for (const Token &t : l.tokens) out << t.kind << " " << t.lexeme << "\n";
+    out << "NEWLINE\n";
+  }
+}
+
+int64_t toNumber(const Token &t) {
+  if (t.kind == "HEXINT") return stoll(t.lexeme, nullptr, 16);
+  return stoll(t.lexeme);
+}
+
+int regNumber(const Token &t) {
+  return stoi(t.lexeme.substr(1));
+}
+
+// How far the store-forwarding and constant patterns look ahead.
+const int WINDOW = 8;
+
+class Peephole;
+
+class Pattern {
+  public:
+  string name;
+  bool (Peephole::*apply)(int p);
+  int rewrites;
+};
+
+class Peephole {
+    vector<Line> &lines;
+    vector<int> at;           // line index of each instruction
+    vector<bool> target;      // instruction is the target of a numeric branch
+    vector<bool> pinned;      // instruction lies inside a numeric branch's span
+    vector<Pattern> patterns;
+
+    const vector<Token> &insn(int p) { return lines[at[p]].tokens; }
+    bool deleted(int p) { return insn(p).empty(); }
+    string op(int p) { return insn(p)[0].lexeme; }
+    bool is(int p, const string &name) { return !deleted(p) && insn(p)[0].kind == "ID" && op(p) == name; }
+    int reg(int p, int k) { return regNumber(insn(p).at(k)); }
+    // Line of the .word operand of the lis on line j: the next line with
+    // tokens, since blank and comment-only lines still end in NEWLINE.
+    int operand(int j) {
+      for (++j; j < (int)lines.size(); ++j) if (!lines[j].tokens.empty()) return j;
+      return j;
+    }
+    // The .word operand of a lis, as a comparable string.
+    string lisValue(int p) {
+      const Token &t = lines.at(operand(at[p])).tokens.at(1);
+      return t.kind == "ID" ? t.lexeme : to_string((uint32_t)toNumber(t));
+    }
+    // Deleting p must not change the distance a numeric branch jumps.
+    bool removable(int p) { return !pinned[p]; }
+    void remove(int p) {
+      if (is(p, "lis") && operand(at[p]) < (int)lines.size()) lines[operand(at[p])].tokens.clear();
+      lines[at[p]].tokens.clear();
+    }
+    void replace(int p, vector<Token> t) { lines[at[p]].tokens = t; }
+    vector<Token> move(int dst, int src) {
+      return {Token("ID", "add"), Token("REGISTER", "$" + to_string(dst)), Token("COMMA", ","),
+              Token("REGISTER", "$" + to_string(src)), Token("COMMA", ","), Token("REGISTER", "$0")};
+    }
+    // Next instruction that has not been deleted, or -1.
+    int next(int p) {
+      for (++p; p < (int)at.size(); ++p) if (!deleted(p)) return p;
+      return -1;
+    }
+    // True if control can arrive at p other than from the instruction
+    // before it: a numeric branch lands on p, or a label sits on p or on a
+    // label-only or deleted line just above it.
+    bool entry(int p) {
+      if (target[p]) return true;
+      for (int j = at[p]; j >= 0; --j) {
+        if (j < at[p] && !lines[j].tokens.empty()) return false;
+        if (!lines[j].labels.empty()) return true;
+      }
+      return false;
+    }
+    // True if the label names the start of instruction q, or the end of
+    // the program when q is -1.
+    bool labels(int from, int q, const string &label) {
+      int last = q < 0 ? lines.size() - 1 : at[q];
+      for (int j = from; j <= last; ++j) {
+        for (const string &l : lines[j].labels) if (l == label + ":") return true;
+      }
+      return false;
+    }
+    // Register written by p, 0 if none. Anything that transfers control,
+    // stray data and unknown instructions are barriers (-1).
+    int writes(int p) {
+      const vector<Token> &t = insn(p);
+      if (t[0].kind != "ID") return -1;
+      string o = t[0].lexeme;
+      if (o == "add" || o == "sub" || o == "slt" || o == "sltu" || o == "mfhi" || o == "mflo" || o == "lis" || o == "lw") {
+        return regNumber(t[1]);
+      }
+      if (o == "mult" || o == "multu" || o == "div" || o == "divu" || o == "sw") return 0;
+      return -1;
+    }
+    bool sameAddress(int p, int q) {
+      return reg(p, 5) == reg(q, 5) && toNumber(insn(p).at(3)) == toNumber(insn(q).at(3));
+    }
+
+    void findSpans();
+    bool noOp(int p);
+    bool cancel(int p);
+    bool storeLoad(int p);
+    bool lisReload(int p);
+    bool branchNext(int p);
+    bool unreachable(int p);
+
+    public:
+    Peephole(vector<Line> &l);
+    void run();
+    void report(ostream &out);
+};
+
+Peephole::Peephole(vector<Line> &l) : lines(l) {
+  patterns = {
+    {"no-op", &Peephole::noOp, 0},
+    {"add/sub cancel", &Peephole::cancel, 0},
+    {"store-load", &Peephole::storeLoad, 0},
+    {"lis reload", &Peephole::lisReload, 0},
+    {"branch to next", &Peephole::branchNext, 0},
+    {"unreachable", &Peephole::unreachable, 0},
+  };
+}
+
+// add $a, $a, $0 and friends; anything but lw whose destination is $0.
+bool Peephole::noOp(int p) {
+  if (!removable(p)) return false;
+  if (is(p, "add") || is(p, "sub")) {
+    int d = reg(p, 1), s = reg(p, 3), t = reg(p, 5);
+    if (d == 0 || (t == 0 && d == s) || (is(p, "add") && s == 0 && d == t)) {
+      remove(p);
+      return true;
+    }
+  }
+  if ((is(p, "slt") || is(p, "sltu") || is(p, "mfhi") || is(p, "mflo")) && reg(p, 1) == 0) {
+    remove(p);
+    return true;
+  }
+  return false;
+}
+
+// sub $r, $r, $x followed by add $r, $r, $x (or the reverse), as left by
+// a push immediately followed by a pop.
+bool Peephole::cancel(int p) {
+  if (!is(p, "add") && !is(p, "sub")) return false;
+  int q = next(p);
+  if (q < 0 || entry(q) || !(is(q, "add") || is(q, "sub")) || op(q) == op(p)) return false;
+  if (!removable(p) || !removable(q)) return false;
+  int r = reg(p, 1), x = reg(p, 5);
+  if (r == x || r == 0 || reg(p, 3) != r || reg(q, 1) != r || reg(q, 3) != r || reg(q, 5) != x) return false;
+  remove(p);
+  remove(q);
+  return true;
+}
+
+// sw $a, k($b) ... lw $c, k($b) becomes sw $a, k($b) ... add $c, $a, $0
+// when neither $a nor $b changes in between and no store may alias.
+bool Peephole::storeLoad(int p) {
+  if (!is(p, "sw")) return false;
+  int a = reg(p, 1), b = reg(p, 5);
+  int q = p;
+  for (int n = 0; n < WINDOW; ++n) {
+    q = next(q);
+    if (q < 0 || entry(q)) return false;
+    if (is(q, "lw") && sameAddress(p, q)) {
+      if (reg(q, 1) == a && removable(q)) remove(q);
+      else replace(q, move(reg(q, 1), a));
+      return true;
+    }
+    if (is(q, "sw") && !(reg(q, 5) == b && toNumber(insn(q).at(3)) != toNumber(insn(p).at(3)))) return false;
+    int w = writes(q);
+    if (w < 0 || (w != 0 && (w == a || w == b))) return false;
+  }
+  return false;
+}
+
+// lis $a with the value $a already holds.
+bool Peephole::lisReload(int p) {
+  if (!is(p, "lis") || reg(p, 1) == 0) return false;
+  int a = reg(p, 1);
+  string v = lisValue(p);
+  int q = p;
+  for (int n = 0; n < WINDOW; ++n) {
+    q = next(q);
+    if (q < 0 || entry(q)) return false;
+    if (is(q, "lis") && reg(q, 1) == a && lisValue(q) == v && removable(q)) {
+      remove(q);
+      return true;
+    }
+    int w = writes(q);
+    if (w < 0 || w == a) return false;
+  }
+  return false;
+}
+
+// beq/bne whose target is the instruction after it.
+bool Peephole::branchNext(int p) {
+  if ((!is(p, "beq") && !is(p, "bne")) || !removable(p)) return false;
+  const Token &target = insn(p).at(5);
+  int q = next(p);
+  if (target.kind == "ID" ? !labels(at[p] + 1, q, target.lexeme) : toNumber(target) != 0) return false;
+  remove(p);
+  return true;
+}
+
+// Instructions after an unconditional jump that no label leads to. Stops
+// at data, which may be addressed by offset from a label.
+bool Peephole::unreachable(int p) {
+  bool jump = is(p, "jr") || (is(p, "beq") && reg(p, 1) == 0 && reg(p, 3) == 0);
+  if (!jump) return false;
+  int q = next(p);
+  if (q < 0 || entry(q) || !removable(q) || insn(q)[0].kind != "ID") return false;
+  remove(q);
+  return true;
+}
+
+// A beq or bne with a numeric offset counts words, so it is kept correct
+// by marking its target as an entry point and pinning every instruction
+// whose deletion would change the count: those strictly between a forward
+// branch and its target, and from the target through the branch itself
+// when it jumps backward.
+void Peephole::findSpans() {
+  vector<int> word(at.size() + 1);  // word address of each instruction
+  for (size_t p = 0; p < at.size(); ++p) word[p + 1] = word[p] + (op(p) == "lis" ? 2 : 1);
+  auto first = [&](int w) {         // first instruction at word w or after
+    return lower_bound(word.begin(), word.end() - 1, w) - word.begin();
+  };
+  target.assign(at.size(), false);
+  pinned.assign(at.size(), false);
+  for (size_t p = 0; p < at.size(); ++p) {
+    if (!is(p, "beq") && !is(p, "bne")) continue;
+    const Token &t = insn(p).at(5);
+    if (t.kind == "ID") continue;
+    int64_t dest = word[p] + 1 + toNumber(t);
+    size_t q = first(max<int64_t>(0, min<int64_t>(dest, word.back())));
+    if (q < at.size() && word[q] == dest) target[q] = true;
+    size_t lo = dest > word[p] ? p + 1 : q, hi = dest > word[p] ? q : p + 1;
+    for (size_t r = lo; r < hi; ++r) pinned[r] = true;
+  }
+}
+
+void Peephole::run() {
+  bool changed = true;
+  while (changed) {
+    changed = false;
+    at.clear();
+    for (size_t j = 0; j < lines.size(); ++j) {
+      if (lines[j].tokens.empty()) continue;
+      at.push_back(j);
+      // The word after lis is its operand, not an instruction.
+      if (lines[j].tokens[0].lexeme == "lis") j = operand(j);
+    }
+    findSpans();
+    for (int p = 0; p < (int)at.size(); ++p) {
+      for (Pattern &pat : patterns) {
+        if (deleted(p)) break;
+        if ((this->*pat.apply)(p)) {
+          ++pat.rewrites;
+          changed = true;
+        }
+      }
+    }
+  }
+}
+
+void Peephole::report(ostream &out) {
+  int total = 0;
+  for (const Pattern &pat : patterns) {
+    out << pat.name << ": " << pat.rewrites << "\n";
+    total += pat.rewrites;
+  }
+  out << "total: " << total << " rewrites\n";
+}
+
+int main() {
+  try {
+    vector<Line> lines = readLines(cin);
+    Peephole peep(lines);
+    peep.run();
+    writeLines(cout, lines);
+    peep.report(cerr);
+  } catch(runtime_error &e) {
+    cerr << "ERROR: " << e.what() << "\n";
+    return 1;
+  } catch(exception &e) {
+    cerr << "ERROR: malformed input\n";
+    return 1;
+  }
+  return 0;
+}
@@ -4,6 +4,18 @@
 #include <utility>
 #include <sstream>
 #include <cstring>
+#include <array>
+#include <map>
+#include <unordered_map>
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <memory>
+#include <cstdio>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include "dfa.h"
 using namespace std;
 
@@ -63,45 +75,327 @@ start    ; ?COMMENT
 ?COMMENT \x00-\x09 \x0B \x0C \x0E-\x7F ?COMMENT
 )";
 */
+// States are numbered as the spec lists them while it is read. minimize()
+// then drops unreachable states, merges equivalent ones with Hopcroft's
+// algorithm and splits the characters into classes that every state treats
+// alike, so the scanning table is states x classes rather than states x 128.
+// Accepting states are never merged with each other: their names are the
+// token kinds.
+//
+// A built DFA can be saved in a compiled form and mapped back in later
+// instead of reading the spec again:
+//   magic "MDFA", version, spec hash and size (u64), states, classes,
+//   initial state, size of the names     40 bytes, native byte order
+//   class of each character              256 bytes
+//   transition table                     states x classes int32, -1 for none
+//   accepting states                     bitmap, (states + 7) / 8 bytes
+//   state names                          each ending in a NUL
+const uint32_t DFA_MAGIC = 'M' | 'D' << 8 | 'F' << 16 | 'A' << 24;
+const uint32_t DFA_VERSION = 2;
+
+struct CompiledHeader {
+  uint32_t magic, version;
+  uint64_t specHash, specSize;
+  uint32_t states, classes, initial, namesSize;
+};
+
+class MappedFile {
+  public:
+    const unsigned char *data = nullptr;
+    size_t size = 0;
+    // Leaves data null if the file cannot be mapped.
+    MappedFile(const string &path) {
+      int fd = open(path.c_str(), O_RDONLY);
+      if (fd < 0) return;
+      struct stat st;
+      if (fstat(fd, &st) == 0 && st.st_size > 0) {
+        void *p = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (p != MAP_FAILED) {
+          data = (const unsigned char *)p;
+          size = st.st_size;
+        }
+      }
+      close(fd);
+    }
+    ~MappedFile() { if (data) munmap((void *)data, size); }
+    MappedFile(const MappedFile &) = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
+};
+
 class DFA{
-    vector<pair<string, bool>> states;
-    vector<pair<string, pair<char,string>>> transitions; 
+    unordered_map<string, int> ids;
+    vector<string> names;
+    vector<bool> accepting;
+    vector<array<int, 128>> delta;  // as read, -1 for no transition
+    int classes = 0;
+    unsigned char classOf[256];
+    vector<int> table;              // state * classes + class, -1 for none
+    const int *cells = nullptr;     // table, or the one in a mapped compiled DFA
+    unique_ptr<MappedFile> mapping;
+
+    vector<int> characterClasses(const vector<array<int, 128>> &d, int &count);
 
     public:
-    pair<string,bool> initial;
-    bool getAccept(string s){ 
-        for(auto n : states){
-            if(n.first == s) return n.second;
-        }
-        throw runtime_error("Invalid state!");
+    int initial = 0;
+    int specStates = 0;
+    DFA() {}
+    DFA(DFA &&) = default;
+    DFA(const DFA &) = delete;
+    DFA &operator=(DFA &&) = default;
+    bool getAccept(int s) const { return accepting[s]; }
+    const string &name(int s) const { return names[s]; }
+    int size() const { return names.size(); }
+    int classCount() const { return classes; }
+    int state(const string &s) const {
+      auto it = ids.find(s);
+      if (it == ids.end()) throw runtime_error("Invalid state!");
+      return it->second;
     }
     void addState(string s, bool accept){
-        states.push_back(make_pair(s,accept));
-    }
-    void addTransition(string s1, char c, string s2){ 
-        bool check1 = false;
-        bool check2 = false;
-        for(auto n: states){
-            if (n.first == s1) check1 = true;
-            if (n.first == s2) check2 = true;
-        }
-        if (!(check1 && check2)) throw runtime_error("Invalid state!");
-        transitions.push_back(make_pair(s1,make_pair(c,s2)));
-    }
-    string getNextState(string s, char c){ 
-        bool check = false;
-        for(auto n: transitions){
-            if (n.first == s){
-                    if (n.second.first == c){
-                        check = true;
-                        return n.second.second;
-                    }
-            }
-        }
-        if (!(check)) return "novalidstate";
+      if (!ids.emplace(s, names.size()).second) throw runtime_error("Duplicate state " + s);
+      names.push_back(s);
+      accepting.push_back(accept);
+      array<int, 128> none;
+      none.fill(-1);
+      delta.push_back(none);
+    }
+    // The first transition listed for a state and character wins.
+    void addTransition(int s1, char c, int s2){
+      int &t = delta[s1][(unsigned char)c];
+      if (t < 0) t = s2;
     }
+    void minimize();
+    int getNextState(int s, char c) const {
+      return cells[s * classes + classOf[(unsigned char)c]];
+    }
+    void save(ostream &out, uint64_t specHash, uint64_t specSize) const;
+    bool load(unique_ptr<MappedFile> file, uint64_t specHash, uint64_t specSize);
 };
 
+// Classes of characters with identical columns in d; returns each
+// character's class (characters above 127 have no transitions).
+vector<int> DFA::characterClasses(const vector<array<int, 128>> &d, int &count) {
+  map<vector<int>, int> columns;
+  vector<int> cls(256);
+  vector<int> column(d.size());
+  for (int c = 0; c < 256; ++c) {
+    for (size_t s = 0; s < d.size(); ++s) column[s] = c < 128 ? d[s][c] : -1;
+    cls[c] = columns.emplace(column, columns.size()).first->second;
+  }
+  count = columns.size();
+  return cls;
+}
+
+void DFA::minimize() {
+  specStates = names.size();
+  // Reachable states, renumbered in breadth-first order from the start.
+  vector<int> order(1, initial), renumber(names.size(), -1);
+  renumber[initial] = 0;
+  for (size_t i = 0; i < order.size(); ++i) {
+    for (int t : delta[order[i]]) {
+      if (t >= 0 && renumber[t] < 0) {
+        renumber[t] = order.size();
+        order.push_back(t);
+      }
+    }
+  }
+  int n = order.size();
+  int dead = n;  // stands for every missing transition
+  int k;
+  vector<int> cls = characterClasses(delta, k);
+  vector<int> rep(k);
+  for (int c = 127; c >= 0; --c) rep[cls[c]] = c;
+  // next[s * k + a] over states 0..n, the dead state included.
+  vector<int> next((n + 1) * k, dead);
+  for (int s = 0; s < n; ++s) {
+    for (int a = 0; a < k; ++a) {
+      int t = rep[a] < 128 ? delta[order[s]][rep[a]] : -1;
+      if (t >= 0) next[s * k + a] = renumber[t];
+    }
+  }
+  // Predecessors by class, as offsets into one array.
+  vector<int> predStart((n + 1) * k + 1, 0), pred((n + 1) * k);
+  for (int s = 0; s <= n; ++s) {
+    for (int a = 0; a < k; ++a) ++predStart[next[s * k + a] * k + a + 1];
+  }
+  for (size_t i = 1; i < predStart.size(); ++i) predStart[i] += predStart[i - 1];
+  {
+    vector<int> fill(predStart.begin(), predStart.end() - 1);
+    for (int s = 0; s <= n; ++s) {
+      for (int a = 0; a < k; ++a) pred[fill[next[s * k + a] * k + a]++] = s;
+    }
+  }
+  // Refinable partition: block b holds elems[first[b] .. end[b]), the
+  // marked ones at the front.
+  vector<int> elems(n + 1), loc(n + 1), blockOf(n + 1);
+  vector<int> first, end, marked;
+  int pos = 0;
+  auto newBlock = [&](const vector<int> &members) {
+    int b = first.size();
+    first.push_back(pos);
+    for (int s : members) {
+      elems[pos] = s;
+      loc[s] = pos++;
+      blockOf[s] = b;
+    }
+    end.push_back(pos);
+    marked.push_back(0);
+  };
+  // The dead state starts in a block of its own: a rejecting state that
+  // still has transitions keeps consuming input under maximal munch, even
+  // if it can never reach acceptance, so it must not become missing.
+  vector<int> rejecting;
+  for (int s = 0; s < n; ++s) if (!accepting[order[s]]) rejecting.push_back(s);
+  newBlock(rejecting);
+  newBlock(vector<int>(1, dead));
+  for (int s = 0; s < n; ++s) if (accepting[order[s]]) newBlock(vector<int>(1, s));
+  // Worklist of (block, class) splitters.
+  vector<char> waiting((n + 1) * k, 0);
+  vector<pair<int, int>> work;
+  for (int b = 1; b < (int)first.size(); ++b) {
+    for (int a = 0; a < k; ++a) {
+      waiting[b * k + a] = 1;
+      work.push_back(make_pair(b, a));
+    }
+  }
+  vector<int> touched, splitter;
+  while (!work.empty()) {
+    int b = work.back().first, a = work.back().second;
+    work.pop_back();
+    waiting[b * k + a] = 0;
+    splitter.assign(elems.begin() + first[b], elems.begin() + end[b]);
+    for (int t : splitter) {
+      for (int i = predStart[t * k + a]; i < predStart[t * k + a + 1]; ++i) {
+        int s = pred[i], y = blockOf[s];
+        int j = first[y] + marked[y];
+        if (loc[s] < j) continue;  // already marked
+        if (marked[y]++ == 0) touched.push_back(y);
+        int other = elems[j];
+        swap(elems[loc[s]], elems[j]);
+        loc[other] = loc[s];
+        loc[s] = j;
+      }
+    }
+    for (int y : touched) {
+      int m = marked[y];
+      marked[y] = 0;
+      if (m == end[y] - first[y]) continue;
+      // The marked front of y becomes a new block.
+      int z = first.size();
+      first.push_back(first[y]);
+      end.push_back(first[y] + m);
+      marked.push_back(0);
+      first[y] += m;
+      for (int i = first[z]; i < end[z]; ++i) blockOf[elems[i]] = z;
+      for (int c = 0; c < k; ++c) {
+        if (waiting[y * k + c] || m <= end[y] - first[y]) {
+          waiting[z * k + c] = 1;
+          work.push_back(make_pair(z, c));
+        } else {
+          waiting[y * k + c] = 1;
+          work.push_back(make_pair(y, c));
+        }
+      }
+    }
+    touched.clear();
+  }
+  // One state per block but the dead state's, numbered from the start.
+  int blocks = first.size();
+  vector<int> number(blocks, -1), members;
+  number[blockOf[0]] = 0;
+  members.push_back(0);
+  for (size_t i = 0; i < members.size(); ++i) {
+    for (int a = 0; a < k; ++a) {
+      int t = next[members[i] * k + a], b = blockOf[t];
+      if (b != blockOf[dead] && number[b] < 0) {
+        number[b] = members.size();
+        members.push_back(t);
+      }
+    }
+  }
+  vector<string> minNames;
+  vector<bool> minAccepting;
+  vector<array<int, 128>> minDelta(members.size());
+  for (size_t i = 0; i < members.size(); ++i) {
+    int s = members[i];
+    minNames.push_back(names[order[s]]);
+    minAccepting.push_back(accepting[order[s]]);
+    for (int c = 0; c < 128; ++c) {
+      int b = blockOf[next[s * k + cls[c]]];
+      minDelta[i][c] = b == blockOf[dead] ? -1 : number[b];
+    }
+  }
+  names.swap(minNames);
+  accepting.swap(minAccepting);
+  ids.clear();
+  initial = 0;
+  // Merged states may now treat more characters alike.
+  cls = characterClasses(minDelta, classes);
+  for (int c = 0; c < 256; ++c) classOf[c] = cls[c];
+  table.assign(names.size() * classes, -1);
+  for (size_t s = 0; s < names.size(); ++s) {
+    for (int c = 0; c < 128; ++c) table[s * classes + classOf[c]] = minDelta[s][c];
+  }
+  cells = table.data();
+  delta.clear();
+}
+
+void DFA::save(ostream &out, uint64_t specHash, uint64_t specSize) const {
+  string allNames;
+  for (const string &n : names) allNames += n + '\0';
+  CompiledHeader h = { DFA_MAGIC, DFA_VERSION, specHash, specSize, (uint32_t)names.size(),
+                       (uint32_t)classes, (uint32_t)initial, (uint32_t)allNames.size() };
+  vector<unsigned char> bits((names.size() + 7) / 8, 0);
+  for (size_t s = 0; s < names.size(); ++s) if (accepting[s]) bits[s / 8] |= 1 << s % 8;
+  out.write((const char *)&h, sizeof h);
+  out.write((const char *)classOf, sizeof classOf);
+  out.write((const char *)cells, sizeof(int) * names.size() * classes);
+  out.write((const char *)bits.data(), bits.size());
+  out.write(allNames.data(), allNames.size());
+}
+
+// Uses a compiled DFA in place if it was built from this spec; false if it
+// is missing, stale or damaged.
+bool DFA::load(unique_ptr<MappedFile> file, uint64_t specHash, uint64_t specSize) {
+  if (!file->data || file->size < sizeof(CompiledHeader) + sizeof classOf) return false;
+  CompiledHeader h;
+  memcpy(&h, file->data, sizeof h);
+  if (h.magic != DFA_MAGIC || h.version != DFA_VERSION || h.specHash != specHash || h.specSize != specSize) {
+    return false;
+  }
+  uint64_t tableBytes = (uint64_t)sizeof(int) * h.states * h.classes;
+  if (h.states == 0 || h.classes == 0 || h.classes > 256 || h.initial >= h.states ||
+      file->size != sizeof h + sizeof classOf + tableBytes + (h.states + 7) / 8 + h.namesSize) {
+    return false;
+  }
+  const unsigned char *p = file->data + sizeof h;
+  for (int c = 0; c < 256; ++c) if (p[c] >= h.classes) return false;
+  const int *t = (const int *)(p + sizeof classOf);
+  for (uint64_t i = 0; i < (uint64_t)h.states * h.classes; ++i) {
+    if (t[i] < -1 || t[i] >= (int)h.states) return false;
+  }
+  const unsigned char *bits = p + sizeof classOf + tableBytes;
+  const char *n = (const char *)bits + (h.states + 7) / 8, *nend = n + h.namesSize;
+  vector<string> ns;
+  while (n < nend && ns.size() < h.states) {
+    const char *z = (const char *)memchr(n, 0, nend - n);
+    if (!z) return false;
+    ns.push_back(string(n, z));
+    n = z + 1;
+  }
+  if (ns.size() != h.states || n != nend) return false;
+  names.swap(ns);
+  accepting.assign(h.states, false);
+  for (uint32_t s = 0; s < h.states; ++s) accepting[s] = bits[s / 8] >> s % 8 & 1;
+  memcpy(classOf, p, sizeof classOf);
+  classes = h.classes;
+  initial = h.initial;
+  specStates = h.states;
+  cells = t;
+  mapping = move(file);
+  return true;
+}
+
 //Helper Functions
 
 bool isChar(string s) {
@@ -237,30 +531,24 @@ void check_restrict(string state, string token){
   cout << state << " " << token << endl;
 }
 
-void maxmunch(string s, DFA &dfa){ 
-  string state = dfa.initial.first;
-  string token = "";
+void maxmunch(const string &s, const DFA &dfa){ 
+  int state = dfa.initial;
+  size_t start = 0;
 
-  while(s.length() > 0){
-    char c = s.front(); 
-    string next = dfa.getNextState(state, c);
-    if (next != "novalidstate"){
-      token += c; 
-      s.erase(0,1);
+  for (size_t i = 0; i < s.length(); ) {
+    int next = dfa.getNextState(state, s[i]);
+    if (next >= 0){
       state = next;
+      ++i;
+    } else if (dfa.getAccept(state) && i > start) {
+      check_restrict(dfa.name(state), s.substr(start, i - start));
+      state = dfa.initial;
+      start = i;
     } else {
-      if (dfa.getAccept(state)) {
-        check_restrict(state, token);
-        state = dfa.initial.first;
-        token = "";
-      }
-      else {
-        throw runtime_error("invalid transition state");
-        return;
-      } 
+      throw runtime_error("invalid transition state");
     }
   }
-  if (dfa.getAccept(state)) check_restrict(state, token);
+  if (dfa.getAccept(state)) check_restrict(dfa.name(state), s.substr(start));
   else throw runtime_error("end of input not accepted");
 }
 
@@ -300,7 +588,7 @@ DFA DFAconstruct(istream &in) {
     }
 
     dfa.addState(s, accepting);
-    if (first) dfa.initial = make_pair(s, accepting);
+    if (first) dfa.initial = dfa.size() - 1;
     first = false;
   }
   // Get transitions
@@ -327,10 +615,9 @@ DFA DFAconstruct(istream &in) {
         ("Incomplete transition line: " + lineStr);
     }
     // Extract state information from the line
-    string fromState = lineVec.front();
-    string toState = lineVec.back();
+    int fromState = dfa.state(lineVec.front());
+    int toState = dfa.state(lineVec.back());
     // Extract character and range information from the line
-    vector<char> charVec;
     for(int i = 1; i < lineVec.size()-1; ++i) {
       string charOrRange = escape(lineVec[i]);
       if (isChar(charOrRange)) {
@@ -340,10 +627,15 @@ DFA DFAconstruct(istream &in) {
             ("Invalid (non-ASCII) character in transition line: " + lineStr + "\n"
              + "Character " + unescape(string(1,c)) + " is outside ASCII range");
         }
-        charVec.push_back(c);
+        dfa.addTransition(fromState, c, toState);
       } else if (isRange(charOrRange)) {
-        for(char c = charOrRange[0]; charOrRange[0] <= c && c <= charOrRange[2]; ++c) {
-          charVec.push_back(c);
+        int lo = (unsigned char)charOrRange[0], hi = (unsigned char)charOrRange[2];
+        if (lo > 127 || hi > 127) {
+          throw runtime_error
+            ("Invalid (non-ASCII) range in transition line: " + lineStr);
+        }
+        for(int c = lo; c <= hi; ++c) {
+          dfa.addTransition(fromState, c, toState);
         }
       } else {
         throw runtime_error
@@ -351,17 +643,75 @@ DFA DFAconstruct(istream &in) {
            + charOrRange + " in transition line: " + lineStr);
       }
     }
-    for ( char c : charVec ) {
-        dfa.addTransition(fromState, c, toState); 
+  }
+  dfa.minimize();
+  return dfa;
+}
+
+uint64_t fnv1a(const string &s) {
+  uint64_t h = 14695981039346656037ull;
+  for (unsigned char c : s) h = (h ^ c) * 1099511628211ull;
+  return h;
+}
+
+// The DFA for a spec file, mapped from its compiled form at spec.bin when
+// that was built from the same spec text; otherwise built from the spec and
+// saved there for next time. Failing to save is not an error.
+DFA loadSpec(const string &path, bool &fromCache) {
+  ifstream in(path, ios::binary);
+  if (!in) throw runtime_error("cannot open " + path);
+  stringstream text;
+  text << in.rdbuf();
+  string spec = text.str();
+  uint64_t hash = fnv1a(spec);
+  string compiled = path + ".bin";
+  DFA dfa;
+  fromCache = dfa.load(unique_ptr<MappedFile>(new MappedFile(compiled)), hash, spec.size());
+  if (fromCache) return dfa;
+  stringstream s(spec);
+  dfa = DFAconstruct(s);
+  string tmp = compiled + ".tmp" + to_string(getpid());
+  {
+    ofstream out(tmp, ios::binary);
+    if (out) dfa.save(out, hash, spec.size());
+    if (!out) {
+      remove(tmp.c_str());
+      return dfa;
     }
   }
+  if (rename(tmp.c_str(), compiled.c_str()) != 0) remove(tmp.c_str());
   return dfa;
 }
 
-int main(){
+int main(int argc, char *argv[]){
   try {
-    stringstream s(DFAstring);
-    DFA dfa = DFAconstruct(s);
+    bool stats = false;
+    string specFile;
+    for (int i = 1; i < argc; ++i) {
+      string a = argv[i];
+      if (a == "-stats") stats = true;
+      else if (a == "-spec" && i + 1 < argc) specFile = argv[++i];
+      else throw runtime_error("usage: mipsscanner [-stats] [-spec file] < input");
+    }
+    auto start = chrono::steady_clock::now();
+    DFA dfa;
+    bool fromCache = false;
+    if (specFile.empty()) {
+      stringstream s(DFAstring);
+      dfa = DFAconstruct(s);
+    } else {
+      dfa = loadSpec(specFile, fromCache);
+    }
+    if (stats) {
+      double ms = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+      if (fromCache) {
+        cerr << "DFA: " << dfa.size() << " states, " << dfa.classCount() << " character classes, mapped from "
+             << specFile << ".bin in " << ms << " ms" << endl;
+      } else {
+        cerr << "DFA: " << dfa.specStates << " states, " << dfa.size() << " after minimization, "
+             << dfa.classCount() << " character classes, built in " << ms << " ms" << endl;
+      }
+    }
     string input;
     while(getline(cin, input)){
       maxmunch(input, dfa);
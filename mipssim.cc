@@ -0,0 +1,1050 @@
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <utility>
+#include <sstream>
+#include <cstring>
+#include <cstdint>
+#include <cstdlib>
+#include <chrono>
+#include <memory>
+#include <map>
+#include <algorithm>
+#include <sys/mman.h>
+using namespace std;
+
+// Machine layout. Programs are loaded at address 0 and $30 starts at the
+// top of memory; returning to RETADDR through jr ends the run.
+const uint32_t MEMSIZE     = 0x01000000;
+const uint32_t MEMWORDS    = MEMSIZE / 4;
+const uint32_t RETADDR     = 0x8123456c;
+const uint32_t STDIN_ADDR  = 0xffff0004;
+const uint32_t STDOUT_ADDR = 0xffff000c;
+
+// Extra slots in the register file: writes to $0 are redirected to SINK
+// at decode time so $0 never has to be reset, and hi/lo live alongside
+// the general registers.
+const int SINK = 32;
+const int HI   = 33;
+const int LO   = 34;
+const int NREGS = 36;
+
+enum Opcode : uint8_t {
+  DECODE,  // slot has not been decoded yet (calloc'd memory is all DECODE)
+  ADD, SUB, MULT, MULTU, DIV, DIVU, MFHI, MFLO, LIS,
+  LW, SW, SLT, SLTU, BEQ, BNE, JR, JALR,
+  BAD,     // word is not a valid instruction
+  OFFEND,  // sentinel past the last word of memory
+  NUMOPS
+};
+
+// One predecoded word. Register fields are already remapped (SINK for
+// writes to $0), branch immediates are word offsets and lis carries the
+// following word in imm.
+struct Insn {
+  uint8_t op, s, t, d;
+  int32_t imm;
+};
+
+string hexWord(uint32_t w) {
+  char buf[11];
+  snprintf(buf, sizeof(buf), "0x%08x", w);
+  return buf;
+}
+
+// Counters filled in by run<STEP, true>. The per-word arrays are calloc'd,
+// so memory that is never executed costs nothing.
+class Profile {
+    public:
+    uint64_t *hits;    // executions per word
+    uint64_t *taken;   // taken branches per word
+    uint8_t *target;   // word was entered by a branch or jump
+    uint64_t loads, stores;
+
+    // Calling contexts for folded stacks. Frame 0 is the program entry;
+    // instructions are charged to a frame in bulk whenever it changes.
+    class Frame {
+      public:
+      uint32_t func;
+      int parent;
+      uint64_t self;
+    };
+    vector<Frame> frames;
+    map<pair<int, uint32_t>, int> children;
+    vector<pair<uint32_t, int>> shadow;  // return address, frame of caller
+    int cur;
+    uint64_t mark;
+
+    Profile() : loads(0), stores(0), cur(0), mark(0) {
+      hits = (uint64_t*)calloc(MEMWORDS + 1, sizeof(uint64_t));
+      taken = (uint64_t*)calloc(MEMWORDS + 1, sizeof(uint64_t));
+      target = (uint8_t*)calloc(MEMWORDS + 1, 1);
+      if (!hits || !taken || !target) throw runtime_error("out of memory");
+      frames.push_back({0, -1, 0});
+    }
+    ~Profile() { free(hits); free(taken); free(target); }
+    Profile(const Profile &) = delete;
+    Profile &operator=(const Profile &) = delete;
+
+    void charge(uint64_t n) {
+      frames[cur].self += n - mark;
+      mark = n;
+    }
+    void call(uint32_t func, uint32_t ret, uint64_t n) {
+      charge(n);
+      target[func >> 2] = 1;
+      shadow.push_back(make_pair(ret, cur));
+      auto key = make_pair(cur, func);
+      auto it = children.find(key);
+      if (it == children.end()) {
+        frames.push_back({func, cur, 0});
+        it = children.insert(make_pair(key, (int)frames.size() - 1)).first;
+      }
+      cur = it->second;
+    }
+    void jump(uint32_t dest, uint64_t n) {
+      target[dest >> 2] = 1;
+      if (!shadow.empty() && shadow.back().first == dest) {
+        charge(n);
+        cur = shadow.back().second;
+        shadow.pop_back();
+      }
+    }
+};
+
+class Machine {
+    public:
+    int32_t reg[NREGS];
+    vector<uint32_t> mem;
+    Insn *code;
+    uint32_t codeHi;     // one past the highest decoded byte address
+    uint32_t progWords;  // size of the loaded image
+    uint32_t pc;
+    uint64_t steps;
+    istream *in;
+    string out;
+    bool capture;        // keep all output in out instead of flushing it
+    Profile *prof;       // only used by run<STEP, true>
+
+    Machine() : mem(MEMWORDS, 0), codeHi(0), progWords(0), pc(0), steps(0), in(&cin),
+                capture(false), prof(nullptr) {
+      code = (Insn*)calloc(MEMWORDS + 1, sizeof(Insn));
+      if (!code) throw runtime_error("out of memory");
+      code[MEMWORDS].op = OFFEND;
+      memset(reg, 0, sizeof(reg));
+      reg[30] = MEMSIZE;
+      reg[31] = RETADDR;
+    }
+    ~Machine() { free(code); }
+    Machine(const Machine &) = delete;
+    Machine &operator=(const Machine &) = delete;
+
+    void load(const vector<uint32_t> &words) {
+      if (words.size() >= MEMWORDS) throw runtime_error("program too large");
+      for (uint32_t i = 0; i < words.size(); ++i) mem[i] = words[i];
+      progWords = words.size();
+      for (uint32_t i = 0; i < progWords; ++i) decode(i);
+    }
+
+    // Same initial state as another machine, e.g. after its loader ran.
+    void copyFrom(const Machine &other) {
+      mem = other.mem;
+      memcpy(reg, other.reg, sizeof(reg));
+      progWords = other.progWords;
+      pc = other.pc;
+      for (uint32_t i = 0; i < progWords; ++i) decode(i);
+    }
+
+    void decode(uint32_t i);
+    void invalidate(uint32_t i);
+    // With STEP set, executes exactly one instruction and returns. With
+    // PROF set, records into *prof as it goes.
+    template<bool STEP, bool PROF = false> void run();
+
+    int32_t readIn() {
+      int c = in->get();
+      return c == EOF ? -1 : c;
+    }
+    void writeOut(int32_t v) {
+      out += (char)(v & 0xff);
+      if (!capture && out.size() >= (1 << 16)) flush();
+    }
+    void flush() {
+      cout << out;
+      cout.flush();
+      out.clear();
+    }
+    void dumpRegs(ostream &o) {
+      for (int i = 1; i < 32; ++i) {
+        o << "$" << (i < 10 ? "0" : "") << i << " = " << hexWord(reg[i])
+          << (i % 4 == 0 ? "\n" : "   ");
+      }
+      o << "\n";
+    }
+};
+
+void Machine::decode(uint32_t i) {
+  uint32_t w = mem[i];
+  Insn &c = code[i];
+  uint8_t s = (w >> 21) & 31;
+  uint8_t t = (w >> 16) & 31;
+  uint8_t d = (w >> 11) & 31;
+  uint8_t rd = d ? d : SINK;
+  c.op = BAD;
+  c.s = s; c.t = t; c.d = rd;
+  c.imm = (int16_t)(w & 0xffff);
+  uint32_t op = w >> 26;
+  if (op == 0) {
+    uint32_t low11 = w & 0x7ff;
+    uint32_t funct = w & 0x3f;
+    if ((w & 0x7c0) != 0) {
+      // shamt must be zero for every instruction in the subset
+    } else if (funct == 0x20) { c.op = ADD;
+    } else if (funct == 0x22) { c.op = SUB;
+    } else if (funct == 0x2a) { c.op = SLT;
+    } else if (funct == 0x2b) { c.op = SLTU;
+    } else if (low11 == 0x18 && d == 0) { c.op = MULT;
+    } else if (low11 == 0x19 && d == 0) { c.op = MULTU;
+    } else if (low11 == 0x1a && d == 0) { c.op = DIV;
+    } else if (low11 == 0x1b && d == 0) { c.op = DIVU;
+    } else if (funct == 0x10 && s == 0 && t == 0) { c.op = MFHI;
+    } else if (funct == 0x12 && s == 0 && t == 0) { c.op = MFLO;
+    } else if (funct == 0x14 && s == 0 && t == 0) {
+      c.op = LIS;
+      c.imm = (i + 1 < MEMWORDS) ? (int32_t)mem[i + 1] : 0;
+    } else if (funct == 0x08 && t == 0 && d == 0) { c.op = JR;
+    } else if (funct == 0x09 && t == 0 && d == 0) { c.op = JALR;
+    }
+  } else if (op == 0x23) {
+    c.op = LW;
+    c.t = t ? t : SINK;
+  } else if (op == 0x2b) { c.op = SW;
+  } else if (op == 0x04) { c.op = BEQ;
+  } else if (op == 0x05) { c.op = BNE;
+  }
+  if (i * 4 + 8 > codeHi) codeHi = i * 4 + 8;
+}
+
+// Called when a store lands below codeHi. A lis in the previous slot has
+// the stored word baked into its immediate, so it goes stale as well.
+void Machine::invalidate(uint32_t i) {
+  code[i].op = DECODE;
+  if (i > 0 && code[i - 1].op == LIS) code[i - 1].op = DECODE;
+}
+
+template<bool STEP, bool PROF>
+void Machine::run() {
+  static void *const dispatch[NUMOPS] = {
+    &&op_decode,
+    &&op_add, &&op_sub, &&op_mult, &&op_multu, &&op_div, &&op_divu,
+    &&op_mfhi, &&op_mflo, &&op_lis,
+    &&op_lw, &&op_sw, &&op_slt, &&op_sltu, &&op_beq, &&op_bne,
+    &&op_jr, &&op_jalr,
+    &&op_bad, &&op_offend
+  };
+  int32_t *const r = reg;
+  uint32_t *const m = mem.data();
+  Insn *const base = code;
+  Insn *ip = base + (pc >> 2);
+  Profile *const pf = prof;
+  uint64_t n = steps;
+  uint32_t a;
+
+#define COUNT do { ++n; if (PROF) ++pf->hits[WORDOF(ip)]; } while (0)
+#define NEXT do { if (STEP) goto stop; COUNT; goto *dispatch[ip->op]; } while (0)
+#define WORDOF(ip) ((uint32_t)((ip) - base))
+
+  if (pc > MEMSIZE || (pc & 3)) throw runtime_error("bad starting pc " + hexWord(pc));
+  COUNT;
+  goto *dispatch[ip->op];
+
+stop:
+  pc = WORDOF(ip) * 4;
+  steps = n;
+  return;
+
+op_decode:
+  decode(WORDOF(ip));
+  goto *dispatch[ip->op];
+op_add:
+  r[ip->d] = (uint32_t)r[ip->s] + (uint32_t)r[ip->t];
+  ++ip; NEXT;
+op_sub:
+  r[ip->d] = (uint32_t)r[ip->s] - (uint32_t)r[ip->t];
+  ++ip; NEXT;
+op_slt:
+  r[ip->d] = r[ip->s] < r[ip->t];
+  ++ip; NEXT;
+op_sltu:
+  r[ip->d] = (uint32_t)r[ip->s] < (uint32_t)r[ip->t];
+  ++ip; NEXT;
+op_mult: {
+  int64_t p = (int64_t)r[ip->s] * (int64_t)r[ip->t];
+  r[HI] = (int32_t)(p >> 32);
+  r[LO] = (int32_t)p;
+  ++ip; NEXT;
+}
+op_multu: {
+  uint64_t p = (uint64_t)(uint32_t)r[ip->s] * (uint64_t)(uint32_t)r[ip->t];
+  r[HI] = (int32_t)(p >> 32);
+  r[LO] = (int32_t)p;
+  ++ip; NEXT;
+}
+op_div: {
+  int32_t x = r[ip->s], y = r[ip->t];
+  if (y == 0) { pc = WORDOF(ip) * 4; steps = n; throw runtime_error("division by zero at " + hexWord(pc)); }
+  if (x == INT32_MIN && y == -1) { r[LO] = x; r[HI] = 0; }
+  else { r[LO] = x / y; r[HI] = x % y; }
+  ++ip; NEXT;
+}
+op_divu: {
+  uint32_t x = r[ip->s], y = r[ip->t];
+  if (y == 0) { pc = WORDOF(ip) * 4; steps = n; throw runtime_error("division by zero at " + hexWord(pc)); }
+  r[LO] = x / y; r[HI] = x % y;
+  ++ip; NEXT;
+}
+op_mfhi:
+  r[ip->d] = r[HI];
+  ++ip; NEXT;
+op_mflo:
+  r[ip->d] = r[LO];
+  ++ip; NEXT;
+op_lis:
+  r[ip->d] = ip->imm;
+  ip += 2; NEXT;
+op_lw:
+  if (PROF) ++pf->loads;
+  a = (uint32_t)r[ip->s] + (uint32_t)ip->imm;
+  if (a < MEMSIZE && !(a & 3)) {
+    r[ip->t] = m[a >> 2];
+  } else if (a == STDIN_ADDR) {
+    r[ip->t] = readIn();
+  } else {
+    pc = WORDOF(ip) * 4; steps = n;
+    throw runtime_error("lw from bad address " + hexWord(a) + " at " + hexWord(pc));
+  }
+  ++ip; NEXT;
+op_sw:
+  if (PROF) ++pf->stores;
+  a = (uint32_t)r[ip->s] + (uint32_t)ip->imm;
+  if (a < MEMSIZE && !(a & 3)) {
+    m[a >> 2] = r[ip->t];
+    if (a < codeHi) invalidate(a >> 2);
+  } else if (a == STDOUT_ADDR) {
+    writeOut(r[ip->t]);
+  } else {
+    pc = WORDOF(ip) * 4; steps = n;
+    throw runtime_error("sw to bad address " + hexWord(a) + " at " + hexWord(pc));
+  }
+  ++ip; NEXT;
+op_beq:
+  if (r[ip->s] == r[ip->t]) {
+    if (PROF) ++pf->taken[WORDOF(ip)];
+    ip += ip->imm + 1;
+    if (WORDOF(ip) >= MEMWORDS) goto branch_out;
+    if (PROF) pf->target[WORDOF(ip)] = 1;
+  } else {
+    ++ip;
+  }
+  NEXT;
+op_bne:
+  if (r[ip->s] != r[ip->t]) {
+    if (PROF) ++pf->taken[WORDOF(ip)];
+    ip += ip->imm + 1;
+    if (WORDOF(ip) >= MEMWORDS) goto branch_out;
+    if (PROF) pf->target[WORDOF(ip)] = 1;
+  } else {
+    ++ip;
+  }
+  NEXT;
+op_jr:
+  a = r[ip->s];
+  if (a < MEMSIZE && !(a & 3)) {
+    if (PROF) pf->jump(a, n);
+    ip = base + (a >> 2);
+    NEXT;
+  }
+  if (a == RETADDR) {
+    pc = a; steps = n;
+    return;
+  }
+  pc = WORDOF(ip) * 4; steps = n;
+  throw runtime_error("jr to bad address " + hexWord(a) + " at " + hexWord(pc));
+op_jalr:
+  a = r[ip->s];
+  r[31] = (WORDOF(ip) + 1) * 4;
+  if (a < MEMSIZE && !(a & 3)) {
+    if (PROF) pf->call(a, r[31], n);
+    ip = base + (a >> 2);
+    NEXT;
+  }
+  if (a == RETADDR) {
+    pc = a; steps = n;
+    return;
+  }
+  pc = WORDOF(ip) * 4; steps = n;
+  throw runtime_error("jalr to bad address " + hexWord(a) + " at " + hexWord(pc));
+op_bad:
+  pc = WORDOF(ip) * 4; steps = n;
+  throw runtime_error("invalid instruction " + hexWord(m[pc >> 2]) + " at " + hexWord(pc));
+op_offend:
+  pc = MEMSIZE; steps = n;
+  throw runtime_error("pc ran off the end of memory");
+branch_out:
+  steps = n;
+  throw runtime_error("branch target outside memory");
+
+#undef COUNT
+#undef NEXT
+#undef WORDOF
+}
+
+// Dynamic translation of basic blocks to x86-64. Translated code keeps
+// the MIPS registers in Machine::reg (addressed through rbx) and memory in
+// Machine::mem (r12); r13 points at the JitCtx and r14 at the per-word
+// map of translated code. Anything the generated code does not handle
+// inline (MMIO, faults, stores into translated code, invalid words)
+// leaves through an exit that has the interpreter execute that single
+// instruction.
+
+struct JitCtx {
+  uint64_t steps;   // instructions retired inside translated code
+  uint32_t codeHi;  // one past the highest translated byte address
+  int32_t stub;     // exit taken: index of a chainable stub, or below
+};
+const int32_t STUB_INDIRECT = -1;  // jr/jalr, look the target up
+const int32_t STUB_INTERP   = -2;  // interpret the instruction at pc
+
+const size_t JIT_BUFSIZE = 32 << 20;
+const size_t JIT_SLACK   = 64 << 10;  // room for the largest block
+const int MAXBLOCK = 256;
+
+typedef uint32_t (*JitEntry)(int32_t *reg, uint32_t *mem, JitCtx *ctx,
+                             uint8_t *covered, uint8_t *block);
+
+class Jit {
+    Machine &mach;
+    uint8_t *buf;
+    uint8_t *p;           // emit cursor
+    size_t fixed;         // trampoline and epilogue, kept across resets
+    uint8_t *epilogue;
+    uint8_t **blockAt;    // translated entry point per word
+    uint8_t *covered;     // nonzero for words inside a translated block
+    vector<uint32_t> translated;
+    vector<uint8_t*> stubs;
+
+    struct SideExit {
+      uint8_t *fix;
+      uint32_t pc;
+      uint32_t rem;       // block instructions not retired when taking it
+    };
+    vector<SideExit> sides;
+
+    void b(uint8_t x) { *p++ = x; }
+    void d32(uint32_t x) { memcpy(p, &x, 4); p += 4; }
+    void bytes(initializer_list<uint8_t> l) { for (uint8_t x : l) b(x); }
+    void patch(uint8_t *fix, uint8_t *target) {
+      uint32_t rel = (uint32_t)(target - (fix + 4));
+      memcpy(fix, &rel, 4);
+    }
+    // opc x86reg, [rbx + 4*mipsreg]
+    void regOp(uint8_t opc, int x86reg, int mreg) { b(opc); b(0x83 | x86reg << 3); d32(4 * mreg); }
+    void load(int x86reg, int mreg) { regOp(0x8B, x86reg, mreg); }
+    void store(int mreg, int x86reg) { regOp(0x89, x86reg, mreg); }
+    void jmpTo(uint8_t *target) { b(0xE9); d32(0); patch(p - 4, target); }
+    void jccSide(uint8_t cc, uint32_t pc, uint32_t rem) {
+      b(0x0F); b(0x80 | cc); d32(0);
+      sides.push_back({p - 4, pc, rem});
+    }
+    uint8_t *jccFwd(uint8_t cc) { b(0x0F); b(0x80 | cc); d32(0); return p - 4; }
+    void checkAddr(uint32_t pc, uint32_t rem);
+    void exitStub(uint32_t target);
+    void interpStub(uint32_t pc, uint32_t rem);
+    uint8_t *translate(uint32_t pc);
+    uint8_t *lookup(uint32_t pc) {
+      uint8_t *blk = blockAt[pc >> 2];
+      return blk ? blk : translate(pc);
+    }
+
+    public:
+    JitCtx ctx;
+    uint64_t blocks, chains, flushes;
+
+    Jit(Machine &m);
+    ~Jit();
+    Jit(const Jit &) = delete;
+    Jit &operator=(const Jit &) = delete;
+    void reset();
+    void run();
+};
+
+const uint8_t CC_B = 2, CC_AE = 3, CC_E = 4, CC_NE = 5;
+
+Jit::Jit(Machine &m) : mach(m), blocks(0), chains(0), flushes(0) {
+  buf = (uint8_t*)mmap(nullptr, JIT_BUFSIZE, PROT_READ | PROT_WRITE | PROT_EXEC,
+                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (buf == MAP_FAILED) throw runtime_error("cannot map memory for translated code");
+  blockAt = (uint8_t**)calloc(MEMWORDS + 1, sizeof(uint8_t*));
+  covered = (uint8_t*)calloc(MEMWORDS + 1, 1);
+  if (!blockAt || !covered) throw runtime_error("out of memory");
+  memset(&ctx, 0, sizeof(ctx));
+  p = buf;
+  // entry(reg, mem, ctx, covered, block)
+  bytes({0x53, 0x41, 0x54, 0x41, 0x55, 0x41, 0x56});  // push rbx, r12, r13, r14
+  bytes({0x48, 0x89, 0xFB});                          // mov rbx, rdi
+  bytes({0x49, 0x89, 0xF4});                          // mov r12, rsi
+  bytes({0x49, 0x89, 0xD5});                          // mov r13, rdx
+  bytes({0x49, 0x89, 0xCE});                          // mov r14, rcx
+  bytes({0x41, 0xFF, 0xE0});                          // jmp r8
+  // eax = next pc, edx = stub
+  epilogue = p;
+  bytes({0x41, 0x89, 0x55, 0x0C});                    // mov [r13+12], edx
+  bytes({0x41, 0x5E, 0x41, 0x5D, 0x41, 0x5C, 0x5B});  // pop r14, r13, r12, rbx
+  b(0xC3);
+  fixed = p - buf;
+}
+
+Jit::~Jit() {
+  munmap(buf, JIT_BUFSIZE);
+  free(blockAt);
+  free(covered);
+}
+
+// Drops every translation, e.g. when the buffer fills up or the program
+// overwrites code that has been translated.
+void Jit::reset() {
+  for (uint32_t w : translated) blockAt[w] = nullptr;
+  translated.clear();
+  stubs.clear();
+  memset(covered, 0, ctx.codeHi / 4 + 1);
+  ctx.codeHi = 0;
+  p = buf + fixed;
+  ++flushes;
+}
+
+// eax holds a MIPS address: leave unless it is aligned and inside memory.
+void Jit::checkAddr(uint32_t pc, uint32_t rem) {
+  bytes({0xA8, 0x03});                 // test al, 3
+  jccSide(CC_NE, pc, rem);
+  b(0x3D); d32(MEMSIZE);               // cmp eax, MEMSIZE
+  jccSide(CC_AE, pc, rem);
+}
+
+// mov eax, target / mov edx, index / jmp epilogue. Chaining overwrites the
+// first five bytes with a direct jmp to the target block.
+void Jit::exitStub(uint32_t target) {
+  stubs.push_back(p);
+  b(0xB8); d32(target);
+  b(0xBA); d32(stubs.size() - 1);
+  jmpTo(epilogue);
+}
+
+void Jit::interpStub(uint32_t pc, uint32_t rem) {
+  if (rem) { bytes({0x49, 0x81, 0x6D, 0x00}); d32(rem); }  // sub qword [r13], rem
+  b(0xB8); d32(pc);
+  b(0xBA); d32((uint32_t)STUB_INTERP);
+  jmpTo(epilogue);
+}
+
+uint8_t *Jit::translate(uint32_t pc) {
+  if (p + JIT_SLACK > buf + JIT_BUFSIZE) reset();
+  uint8_t *entry = p;
+  Insn *code = mach.code;
+
+  // Find the extent of the block: up to and including the first control
+  // transfer, stopping before anything that cannot be translated.
+  vector<uint32_t> words;
+  uint32_t w = pc >> 2;
+  while ((int)words.size() < MAXBLOCK && w < MEMWORDS) {
+    // Always decode afresh: stores from translated code do not keep the
+    // interpreter's predecoded slots up to date.
+    mach.decode(w);
+    uint8_t op = code[w].op;
+    if (op == BAD || op == OFFEND) break;
+    words.push_back(w);
+    w += (op == LIS) ? 2 : 1;
+    if (op == BEQ || op == BNE || op == JR || op == JALR) break;
+  }
+  uint32_t n = words.size();
+  sides.clear();
+
+  if (n == 0) {
+    interpStub(pc, 0);
+  } else {
+    bytes({0x49, 0x81, 0x45, 0x00}); d32(n);   // add qword [r13], n
+  }
+  bool ended = false;
+  for (uint32_t k = 0; k < n; ++k) {
+    const Insn &c = code[words[k]];
+    uint32_t ipc = words[k] * 4;
+    uint32_t rem = n - k;
+    switch (c.op) {
+    case ADD: load(0, c.s); regOp(0x03, 0, c.t); store(c.d, 0); break;
+    case SUB: load(0, c.s); regOp(0x2B, 0, c.t); store(c.d, 0); break;
+    case SLT:
+    case SLTU:
+      load(0, c.s); regOp(0x3B, 0, c.t);
+      bytes({0x0F, (uint8_t)(c.op == SLT ? 0x9C : 0x92), 0xC0});  // setl/setb al
+      bytes({0x0F, 0xB6, 0xC0});                                  // movzx eax, al
+      store(c.d, 0);
+      break;
+    case MULT:
+    case MULTU:
+      load(0, c.s);
+      regOp(0xF7, c.op == MULT ? 5 : 4, c.t);   // imul/mul dword [t]
+      store(LO, 0); store(HI, 2);
+      break;
+    case DIV:
+    case DIVU:
+      load(1, c.t);
+      bytes({0x85, 0xC9});                      // test ecx, ecx
+      jccSide(CC_E, ipc, rem);
+      if (c.op == DIV) {
+        bytes({0x83, 0xF9, 0xFF});              // cmp ecx, -1
+        jccSide(CC_E, ipc, rem);
+      }
+      load(0, c.s);
+      if (c.op == DIV) bytes({0x99, 0xF7, 0xF9});       // cdq; idiv ecx
+      else bytes({0x31, 0xD2, 0xF7, 0xF1});             // xor edx, edx; div ecx
+      store(LO, 0); store(HI, 2);
+      break;
+    case MFHI: load(0, HI); store(c.d, 0); break;
+    case MFLO: load(0, LO); store(c.d, 0); break;
+    case LIS: b(0xC7); b(0x83); d32(4 * c.d); d32(c.imm); break;
+    case LW:
+      load(0, c.s);
+      b(0x05); d32(c.imm);                      // add eax, imm
+      checkAddr(ipc, rem);
+      bytes({0x41, 0x8B, 0x04, 0x04});          // mov eax, [r12+rax]
+      store(c.t, 0);
+      break;
+    case SW: {
+      load(0, c.s);
+      b(0x05); d32(c.imm);
+      checkAddr(ipc, rem);
+      bytes({0x41, 0x3B, 0x45, 0x08});          // cmp eax, [r13+8]
+      uint8_t *ok = jccFwd(CC_AE);
+      bytes({0x89, 0xC1, 0xC1, 0xE9, 0x02});    // mov ecx, eax; shr ecx, 2
+      bytes({0x41, 0x80, 0x3C, 0x0E, 0x00});    // cmp byte [r14+rcx], 0
+      jccSide(CC_NE, ipc, rem);
+      patch(ok, p);
+      load(1, c.t);
+      bytes({0x41, 0x89, 0x0C, 0x04});          // mov [r12+rax], ecx
+      break;
+    }
+    case BEQ:
+    case BNE: {
+      load(0, c.s); regOp(0x3B, 0, c.t);
+      uint8_t *fall = jccFwd(c.op == BEQ ? CC_NE : CC_E);
+      uint64_t target = (int64_t)ipc + 4 + 4 * (int64_t)c.imm;
+      if (target < MEMSIZE) exitStub(target);
+      else interpStub(ipc, rem);
+      patch(fall, p);
+      exitStub(ipc + 4);
+      ended = true;
+      break;
+    }
+    case JR:
+    case JALR:
+      load(0, c.s);
+      checkAddr(ipc, rem);
+      if (c.op == JALR) { b(0xC7); b(0x83); d32(4 * 31); d32(ipc + 4); }
+      b(0xBA); d32((uint32_t)STUB_INDIRECT);
+      jmpTo(epilogue);
+      ended = true;
+      break;
+    }
+  }
+  if (n > 0 && !ended) exitStub(w * 4);
+  for (const SideExit &s : sides) {
+    patch(s.fix, p);
+    interpStub(s.pc, s.rem);
+  }
+
+  blockAt[pc >> 2] = entry;
+  translated.push_back(pc >> 2);
+  for (uint32_t k : words) {
+    covered[k] = 1;
+    if (code[k].op == LIS) covered[k + 1] = 1;
+  }
+  if (w * 4 > ctx.codeHi) ctx.codeHi = w * 4;
+  ++blocks;
+  return entry;
+}
+
+void Jit::run() {
+  JitEntry enter = (JitEntry)(void*)buf;
+  uint32_t pc = mach.pc;
+  try {
+    uint8_t *blk = lookup(pc);
+    while (true) {
+      pc = enter(mach.reg, mach.mem.data(), &ctx, covered, blk);
+      int32_t stub = ctx.stub;
+      if (stub == STUB_INTERP) {
+        uint32_t w = pc >> 2;
+        if (w < MEMWORDS) mach.decode(w);
+        const Insn &c = mach.code[w];
+        uint32_t a = MEMSIZE;
+        if (c.op == SW) a = (uint32_t)mach.reg[c.s] + (uint32_t)c.imm;
+        mach.pc = pc;
+        mach.run<true>();
+        if (a < MEMSIZE && covered[a >> 2]) reset();
+        pc = mach.pc;
+        if (pc == RETADDR) break;
+        blk = lookup(pc);
+      } else {
+        size_t gen = flushes;
+        blk = lookup(pc);
+        if (stub >= 0 && gen == flushes) {
+          uint8_t *s = stubs[stub];
+          s[0] = 0xE9;
+          patch(s + 1, blk);
+          ++chains;
+        }
+      }
+    }
+  } catch (...) {
+    mach.steps += ctx.steps;
+    ctx.steps = 0;
+    throw;
+  }
+  mach.steps += ctx.steps;
+  ctx.steps = 0;
+  mach.pc = RETADDR;
+}
+
+// Symbol table written by mipsasm: one "label address" pair per line.
+class Symbols {
+    public:
+    vector<pair<uint32_t, string>> byAddr;
+
+    void read(istream &in) {
+      string label, addr;
+      while (in >> label >> addr) byAddr.push_back(make_pair((uint32_t)stoul(addr, nullptr, 0), label));
+      stable_sort(byAddr.begin(), byAddr.end(),
+                  [](const pair<uint32_t, string> &a, const pair<uint32_t, string> &b) { return a.first < b.first; });
+    }
+    bool isLabel(uint32_t addr) {
+      auto it = lower_bound(byAddr.begin(), byAddr.end(), make_pair(addr, string()));
+      return it != byAddr.end() && it->first == addr;
+    }
+    // Nearest label at or before addr, as "label+offset".
+    string where(uint32_t addr) {
+      auto it = upper_bound(byAddr.begin(), byAddr.end(), make_pair(addr, string("\x7f")));
+      if (it == byAddr.begin()) return hexWord(addr);
+      --it;
+      uint32_t off = addr - it->first;
+      return off ? it->second + "+" + to_string(off) : it->second;
+    }
+};
+
+class Block {
+  public:
+  uint32_t start, end;  // word range, end exclusive
+  uint64_t entries, instrs;
+};
+
+string percent(uint64_t part, uint64_t whole) {
+  char buf[16];
+  snprintf(buf, sizeof(buf), "%6.2f%%", whole ? 100.0 * part / whole : 0.0);
+  return buf;
+}
+
+string column(uint64_t v, int width) {
+  string s = to_string(v);
+  return string(s.size() < (size_t)width ? width - s.size() : 0, ' ') + s;
+}
+
+// Splits the executed words into basic blocks. A block starts at the
+// program entry, a branch or jump target, a label, or after a control
+// transfer or a gap in execution.
+vector<Block> findBlocks(Machine &mach, Profile &pf, Symbols &syms) {
+  vector<Block> blocks;
+  bool open = false;
+  uint32_t expect = 0;
+  uint32_t limit = min(mach.codeHi / 4 + 1, MEMWORDS);
+  for (uint32_t w = 0; w < limit; ++w) {
+    if (!pf.hits[w]) continue;
+    if (!open || w != expect || pf.target[w] || syms.isLabel(w * 4)) {
+      blocks.push_back({w, w, pf.hits[w], 0});
+    }
+    if (mach.code[w].op == DECODE) mach.decode(w);
+    uint8_t op = mach.code[w].op;
+    Block &b = blocks.back();
+    b.instrs += pf.hits[w];
+    b.end = w + 1;
+    expect = w + (op == LIS ? 2 : 1);
+    open = !(op == BEQ || op == BNE || op == JR || op == JALR);
+  }
+  return blocks;
+}
+
+void writeHotSpots(ostream &out, Machine &mach, Profile &pf, Symbols &syms) {
+  const size_t TOP = 20;
+  uint64_t total = mach.steps;
+  uint64_t branches = 0, taken = 0;
+  vector<uint32_t> words;
+  uint32_t limit = min(mach.codeHi / 4 + 1, MEMWORDS);
+  for (uint32_t w = 0; w < limit; ++w) {
+    if (!pf.hits[w]) continue;
+    words.push_back(w);
+    uint8_t op = mach.code[w].op;
+    if (op == BEQ || op == BNE) {
+      branches += pf.hits[w];
+      taken += pf.taken[w];
+    }
+  }
+  out << "Profile: " << total << " instructions, " << pf.loads << " loads, " << pf.stores
+      << " stores, " << branches << " branches (" << taken << " taken, "
+      << branches - taken << " not taken)\n\n";
+
+  vector<Block> blocks = findBlocks(mach, pf, syms);
+  stable_sort(blocks.begin(), blocks.end(),
+              [](const Block &a, const Block &b) { return a.instrs > b.instrs; });
+  out << "Hot basic blocks:\n"
+      << "      instrs   share      entries  block\n";
+  for (size_t i = 0; i < blocks.size() && i < TOP; ++i) {
+    Block &b = blocks[i];
+    out << column(b.instrs, 12) << " " << percent(b.instrs, total) << " " << column(b.entries, 12)
+        << "  " << syms.where(b.start * 4) << " [" << hexWord(b.start * 4) << "-"
+        << hexWord(b.end * 4 - 4) << "]\n";
+  }
+
+  stable_sort(words.begin(), words.end(),
+              [&](uint32_t a, uint32_t b) { return pf.hits[a] > pf.hits[b]; });
+  out << "\nHot instructions:\n"
+      << "       count   share  address     location\n";
+  for (size_t i = 0; i < words.size() && i < TOP; ++i) {
+    uint32_t w = words[i];
+    out << column(pf.hits[w], 12) << " " << percent(pf.hits[w], total) << "  " << hexWord(w * 4)
+        << "  " << syms.where(w * 4);
+    uint8_t op = mach.code[w].op;
+    if (op == BEQ || op == BNE) {
+      out << "  (taken " << pf.taken[w] << ", not taken " << pf.hits[w] - pf.taken[w] << ")";
+    }
+    out << "\n";
+  }
+}
+
+// One line per calling context, "entry;caller;callee count", as read by
+// flamegraph.pl and similar tools.
+void writeFolded(ostream &out, Profile &pf, Symbols &syms) {
+  for (size_t i = 0; i < pf.frames.size(); ++i) {
+    if (!pf.frames[i].self) continue;
+    vector<string> names;
+    for (int f = i; f >= 0; f = pf.frames[f].parent) names.push_back(syms.where(pf.frames[f].func));
+    string line;
+    for (auto it = names.rbegin(); it != names.rend(); ++it) {
+      if (!line.empty()) line += ";";
+      line += *it;
+    }
+    out << line << " " << pf.frames[i].self << "\n";
+  }
+}
+
+vector<uint32_t> readProgram(istream &in) {
+  vector<uint32_t> words;
+  unsigned char b[4];
+  while (in.read((char*)b, 4)) {
+    words.push_back((uint32_t)b[0] << 24 | (uint32_t)b[1] << 16 | (uint32_t)b[2] << 8 | b[3]);
+  }
+  if (in.gcount() != 0) throw runtime_error("program size is not a multiple of 4 bytes");
+  return words;
+}
+
+int32_t readInt(istream &in, string prompt) {
+  cerr << prompt;
+  long long v;
+  if (!(in >> v)) throw runtime_error("expected an integer");
+  if (v < INT32_MIN || v > UINT32_MAX) throw runtime_error("integer out of range");
+  return (int32_t)v;
+}
+
+void loadTwoints(Machine &mach) {
+  mach.reg[1] = readInt(cin, "Enter value for register 1: ");
+  mach.reg[2] = readInt(cin, "Enter value for register 2: ");
+}
+
+void loadArray(Machine &mach) {
+  int32_t len = readInt(cin, "Enter length of array: ");
+  if (len < 0 || mach.progWords + (uint32_t)len >= MEMWORDS / 2) {
+    throw runtime_error("bad array length");
+  }
+  for (int32_t i = 0; i < len; ++i) {
+    mach.mem[mach.progWords + i] = readInt(cin, "Enter array element " + to_string(i) + ": ");
+  }
+  mach.reg[1] = mach.progWords * 4;
+  mach.reg[2] = len;
+}
+
+// Tight loop used by -bench: counts $3 down to zero accumulating into $5.
+//   lis $4 / .word 1 / lis $3 / .word n
+//   loop: add $5,$5,$3 / sub $3,$3,$4 / bne $3,$0,loop / jr $31
+vector<uint32_t> benchProgram(uint32_t iterations) {
+  return {
+    0x00002014, 1,
+    0x00001814, iterations,
+    0x00a32820,
+    0x00641822,
+    0x1460fffd,
+    0x03e00008
+  };
+}
+
+void usage() {
+  cerr << "usage: mipssim [-stats] [-jit | -diff] twoints|array program.mips\n"
+       << "       mipssim [-syms file] [-profile report] [-folded stacks] twoints|array program.mips\n"
+       << "       mipssim [-jit] -bench [iterations]\n";
+}
+
+// Runs the machine to completion; returns the error message, or "" if the
+// program returned normally.
+string execute(Machine &mach, bool jit, ostream *stats) {
+  string err;
+  auto start = chrono::steady_clock::now();
+  unique_ptr<Jit> j;
+  try {
+    if (jit) {
+      j.reset(new Jit(mach));
+      j->run();
+    } else if (mach.prof) {
+      mach.run<false, true>();
+      mach.prof->charge(mach.steps);
+    } else {
+      mach.run<false>();
+    }
+  } catch(runtime_error &e) {
+    err = e.what();
+  }
+  double secs = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+  if (stats) {
+    *stats << mach.steps << " instructions in " << secs << " s ("
+           << (secs > 0 ? mach.steps / secs / 1e6 : 0) << " M instructions/s)" << endl;
+    if (j) {
+      *stats << j->blocks << " blocks translated, " << j->chains << " exits chained, "
+             << j->flushes << " flushes" << endl;
+    }
+  }
+  return err;
+}
+
+// Differences between two finished runs, at most a handful of them.
+vector<string> compareRuns(const Machine &a, const Machine &b) {
+  vector<string> diffs;
+  for (int i = 1; i < 32; ++i) {
+    if (a.reg[i] != b.reg[i]) {
+      diffs.push_back("$" + to_string(i) + ": " + hexWord(a.reg[i]) + " vs " + hexWord(b.reg[i]));
+    }
+  }
+  if (a.reg[HI] != b.reg[HI]) diffs.push_back("hi: " + hexWord(a.reg[HI]) + " vs " + hexWord(b.reg[HI]));
+  if (a.reg[LO] != b.reg[LO]) diffs.push_back("lo: " + hexWord(a.reg[LO]) + " vs " + hexWord(b.reg[LO]));
+  for (uint32_t i = 0; i < MEMWORDS && diffs.size() < 8; ++i) {
+    if (a.mem[i] != b.mem[i]) {
+      diffs.push_back("mem[" + hexWord(i * 4) + "]: " + hexWord(a.mem[i]) + " vs " + hexWord(b.mem[i]));
+    }
+  }
+  if (a.out != b.out) diffs.push_back("output differs");
+  if (a.steps != b.steps) {
+    diffs.push_back("instruction count: " + to_string(a.steps) + " vs " + to_string(b.steps));
+  }
+  return diffs;
+}
+
+int main(int argc, char *argv[]) {
+  Machine mach;
+  try {
+    bool stats = false;
+    bool bench = false;
+    bool jit = false;
+    bool diff = false;
+    uint32_t iterations = 100000000;
+    string symsFile, profileFile, foldedFile;
+    vector<string> args;
+    for (int i = 1; i < argc; ++i) {
+      string a = argv[i];
+      bool hasArg = i + 1 < argc;
+      if (a == "-stats") stats = true;
+      else if (a == "-syms" && hasArg) symsFile = argv[++i];
+      else if (a == "-profile" && hasArg) profileFile = argv[++i];
+      else if (a == "-folded" && hasArg) foldedFile = argv[++i];
+      else if (a == "-jit") jit = true;
+      else if (a == "-diff") diff = true;
+      else if (a == "-bench") {
+        bench = stats = true;
+        if (i + 1 < argc && isdigit(argv[i + 1][0])) iterations = stoul(argv[++i]);
+      }
+      else args.push_back(a);
+    }
+    unique_ptr<Profile> prof;
+    if (!profileFile.empty() || !foldedFile.empty()) {
+      if (jit || diff) throw runtime_error("profiling needs the interpreter; drop -jit/-diff");
+      prof.reset(new Profile);
+      mach.prof = prof.get();
+    }
+    Symbols syms;
+    if (!symsFile.empty()) {
+      ifstream in(symsFile);
+      if (!in) throw runtime_error("cannot open " + symsFile);
+      syms.read(in);
+    }
+    if (bench) {
+      mach.load(benchProgram(iterations));
+    } else {
+      if (args.size() != 2 || (args[0] != "twoints" && args[0] != "array")) {
+        usage();
+        return 1;
+      }
+      ifstream prog(args[1], ios::binary);
+      if (!prog) throw runtime_error("cannot open " + args[1]);
+      mach.load(readProgram(prog));
+      if (args[0] == "twoints") loadTwoints(mach);
+      else loadArray(mach);
+    }
+    cerr << "Running MIPS program." << endl;
+    if (diff) {
+      // Both runs see the same input and keep their output until compared.
+      unique_ptr<Machine> other(new Machine);
+      other->copyFrom(mach);
+      stringstream input;
+      input << cin.rdbuf();
+      string text = input.str();
+      istringstream in1(text), in2(text);
+      mach.in = &in1;
+      other->in = &in2;
+      mach.capture = other->capture = true;
+      string err1 = execute(mach, false, stats ? &cerr : nullptr);
+      string err2 = execute(*other, true, stats ? &cerr : nullptr);
+      vector<string> diffs = compareRuns(mach, *other);
+      if (err1 != err2) diffs.insert(diffs.begin(), "interpreter: \"" + err1 + "\" vs translated: \"" + err2 + "\"");
+      mach.flush();
+      for (const string &d : diffs) cerr << "MISMATCH " << d << endl;
+      if (!diffs.empty()) throw runtime_error("interpreted and translated runs differ");
+      cerr << "Interpreted and translated runs match." << endl;
+      if (!err1.empty()) throw runtime_error(err1);
+    } else {
+      string err = execute(mach, jit, stats ? &cerr : nullptr);
+      if (prof) {
+        // Also written when the program faults; that is often when it matters.
+        if (!profileFile.empty()) {
+          ofstream report(profileFile);
+          writeHotSpots(report, mach, *prof, syms);
+        }
+        if (!foldedFile.empty()) {
+          ofstream folded(foldedFile);
+          writeFolded(folded, *prof, syms);
+        }
+      }
+      if (!err.empty()) throw runtime_error(err);
+      mach.flush();
+    }
+    cerr << "MIPS program completed normally." << endl;
+    mach.dumpRegs(cerr);
+  } catch(runtime_error &e) {
+    mach.flush();
+    cerr << "ERROR: " << e.what() << "\n";
+    mach.dumpRegs(cerr);
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,2607 @@
+#include <iostream>
+#include <string>
+#include <vector>
+#include <utility>
+#include <sstream>
+#include <map>
+#include <algorithm>
+#include <cstdint>
+#include <chrono>
+#include <array>
+#include <fstream>
+#include <memory>
+#include <filesystem>
+#include <cstdio>
+using namespace std;
+
+// Reads the parse tree printed by wlp4parser (preorder, one rule or token
+// per line) and writes MIPS assembly that mipsscanner and mipsasm accept.
+// Each procedure is lowered to a linear IR over virtual registers, which
+// linear-scan allocation maps onto machine registers and stack slots.
+
+class Tree {
+  public:
+  string kind;             // rule LHS, or token kind for leaves
+  string lexeme;           // leaves only
+  string rule;             // "expr expr PLUS term"; just the LHS for .EMPTY rules
+  vector<Tree*> children;
+  bool leaf;
+
+  Tree() : leaf(false) {}
+  Tree *child(int i) { return children[i]; }
+  ~Tree() {
+    for (auto &c : children) delete c;
+  }
+};
+
+bool isTerminal(const string &s) {
+  return !s.empty() && isupper(s[0]);
+}
+
+// Iterative so that long procedure and statement lists cannot exhaust the
+// native stack.
+Tree *readTree(istream &in) {
+  Tree *root = nullptr;
+  vector<pair<Tree*, int>> pending;  // node, children still to read
+  do {
+    string line;
+    if (!getline(in, line)) {
+      delete root;
+      throw runtime_error("unexpected end of parse tree");
+    }
+    istringstream ss(line);
+    Tree *t = new Tree;
+    int expect = 0;
+    ss >> t->kind;
+    t->rule = t->kind;
+    if (isTerminal(t->kind)) {
+      t->leaf = true;
+      ss >> t->lexeme;
+    } else {
+      string sym;
+      while (ss >> sym) {
+        if (sym == ":") break;  // type annotation from wlp4type
+        if (sym == ".EMPTY") continue;
+        t->rule += " " + sym;
+        ++expect;
+      }
+    }
+    if (pending.empty()) {
+      root = t;
+    } else {
+      pending.back().first->children.push_back(t);
+      --pending.back().second;
+    }
+    if (expect > 0) pending.push_back(make_pair(t, expect));
+    while (!pending.empty() && pending.back().second == 0) pending.pop_back();
+  } while (!pending.empty());
+  return root;
+}
+
+// ---- IR ----
+
+enum Op {
+  CONST,   // dst = imm
+  MOV,     // dst = a
+  ADD, SUB, MUL, DIV, MOD, SLT, SLTU,  // dst = a op b
+  LOAD,    // dst = mem[a]
+  STORE,   // mem[a] = b
+  LDSLOT,  // dst = frame slot imm
+  STSLOT,  // frame slot imm = a
+  ADDR,    // dst = address of frame slot imm
+  PARAM,   // dst = incoming argument imm
+  CALL,    // dst = callee(args)
+  PRINT,   // println(a)
+  NEW,     // dst = new int[a]
+  DELETE,  // delete [] a
+  INIT,    // set up the heap; b is wain's array and a its length (or ZERO)
+  LABEL,   // imm is the label number
+  JMP,     // goto imm
+  BEQ,     // if (a == b) goto imm
+  BNE,     // if (a != b) goto imm
+  RET,     // return a
+  PHI      // dst = args[k] when entered from predecessor k (SSA form only)
+};
+
+// Virtual register 0 always reads as zero and is never written.
+const int ZERO = 0;
+
+class Ir {
+  public:
+  Op op;
+  int dst, a, b;
+  int imm;
+  string callee;
+  vector<int> args;
+
+  Ir(Op o, int d = -1, int x = -1, int y = -1, int i = 0) : op(o), dst(d), a(x), b(y), imm(i) {}
+
+  bool isBranch() const { return op == JMP || op == BEQ || op == BNE || op == RET; }
+  bool isCall() const { return op == CALL; }
+  vector<int> uses() const {
+    vector<int> u;
+    if (a > ZERO) u.push_back(a);
+    if (b > ZERO) u.push_back(b);
+    for (int v : args) if (v > ZERO) u.push_back(v);
+    return u;
+  }
+  int def() const { return dst > ZERO ? dst : -1; }
+};
+
+// Frame slots: slot k >= 0 is a local slot, slot -(i+1) is incoming
+// argument i.
+class Proc {
+  public:
+  string name;
+  bool isWain;
+  int nparams;
+  int nslots;
+  int nvregs;
+  int nlabels;
+  int statements;
+  vector<int> params;     // vreg of each parameter
+  vector<Ir> code;
+
+  // Filled in by the allocator.
+  vector<int> regOf;      // machine register, or -1 if spilled
+  vector<int> slotOf;     // spill slot of spilled vregs
+  vector<int> start, end; // live interval of each vreg
+
+  // Filled in by the emitter.
+  bool leaf;              // makes no calls, so $31 survives
+  bool frameless;         // leaf with nothing in its frame: no $29 setup
+
+  Proc() : isWain(false), nparams(0), nslots(0), nvregs(1), nlabels(0), statements(0), leaf(false), frameless(false) {}
+  int newVreg() { return nvregs++; }
+  int newLabel() { return nlabels++; }
+  int newSlot() { return nslots++; }
+};
+
+// ---- Lowering from the parse tree ----
+
+enum Type { INT, PTR };
+
+class Var {
+  public:
+  Type type;
+  int vreg;           // home of the value unless addressTaken
+  int slot;
+  bool addressTaken;
+};
+
+class Lowering {
+    Proc &proc;
+    map<string, Var> vars;
+    bool &usesHeap;
+    bool &usesPrint;
+
+    void emit(Ir ir) { proc.code.push_back(ir); }
+    int emitOp(Op op, int a, int b) {
+      int d = proc.newVreg();
+      emit(Ir(op, d, a, b));
+      return d;
+    }
+    int constant(int32_t v) {
+      if (v == 0) return ZERO;
+      int d = proc.newVreg();
+      emit(Ir(CONST, d, -1, -1, v));
+      return d;
+    }
+    Var &lookup(const string &name) {
+      auto it = vars.find(name);
+      if (it == vars.end()) throw runtime_error("undeclared variable " + name + " in " + proc.name);
+      return it->second;
+    }
+    void findAddressTaken(Tree *t);
+    void declare(Tree *dcl, bool param, int index);
+    void assignVar(Var &v, int value);
+    pair<int, Type> expr(Tree *t);
+    pair<int, Type> lvalueAddress(Tree *t);
+    void branchFalse(Tree *test, int label);
+    void statements(Tree *t);
+    void statement(Tree *t);
+    void dcls(Tree *t);
+
+    public:
+    Lowering(Proc &p, bool &heap, bool &print) : proc(p), usesHeap(heap), usesPrint(print) {}
+    void procedure(Tree *t);
+};
+
+void Lowering::findAddressTaken(Tree *t) {
+  if (t->rule == "factor AMP lvalue") {
+    Tree *lv = t->child(1);
+    while (lv->rule == "lvalue LPAREN lvalue RPAREN") lv = lv->child(1);
+    if (lv->rule == "lvalue ID") {
+      auto it = vars.find(lv->child(0)->lexeme);
+      if (it != vars.end()) it->second.addressTaken = true;
+    }
+  }
+  for (Tree *c : t->children) findAddressTaken(c);
+}
+
+void Lowering::declare(Tree *dcl, bool param, int index) {
+  string name = dcl->child(1)->lexeme;
+  if (vars.count(name)) throw runtime_error("duplicate declaration of " + name + " in " + proc.name);
+  Var v;
+  v.type = dcl->child(0)->rule == "type INT STAR" ? PTR : INT;
+  v.vreg = proc.newVreg();
+  v.slot = param && !proc.isWain ? -(index + 1) : 0;
+  v.addressTaken = false;
+  vars[name] = v;
+}
+
+void Lowering::assignVar(Var &v, int value) {
+  if (v.addressTaken) {
+    emit(Ir(STSLOT, -1, value, -1, v.slot));
+    return;
+  }
+  // Retarget the instruction that produced a fresh temporary instead of
+  // copying it.
+  if (!proc.code.empty() && proc.code.back().dst == value && value > ZERO && proc.code.back().op != PARAM) {
+    bool isVar = false;
+    for (auto &kv : vars) if (!kv.second.addressTaken && kv.second.vreg == value) isVar = true;
+    if (!isVar) {
+      proc.code.back().dst = v.vreg;
+      return;
+    }
+  }
+  emit(Ir(MOV, v.vreg, value));
+}
+
+pair<int, Type> Lowering::expr(Tree *t) {
+  const string &r = t->rule;
+  if (r == "expr term" || r == "term factor") return expr(t->child(0));
+  if (r == "factor LPAREN expr RPAREN") return expr(t->child(1));
+  if (r == "expr expr PLUS term" || r == "expr expr MINUS term") {
+    bool plus = r == "expr expr PLUS term";
+    pair<int, Type> x = expr(t->child(0));
+    pair<int, Type> y = expr(t->child(2));
+    if (x.second == INT && y.second == INT) return make_pair(emitOp(plus ? ADD : SUB, x.first, y.first), INT);
+    if (x.second == PTR && y.second == PTR) {
+      // Pointer difference counts words.
+      int bytes = emitOp(SUB, x.first, y.first);
+      return make_pair(emitOp(DIV, bytes, constant(4)), INT);
+    }
+    int p = x.second == PTR ? x.first : y.first;
+    int i = x.second == PTR ? y.first : x.first;
+    int twice = emitOp(ADD, i, i);
+    int scaled = emitOp(ADD, twice, twice);
+    return make_pair(emitOp(plus ? ADD : SUB, p, scaled), PTR);
+  }
+  if (r == "term term STAR factor" || r == "term term SLASH factor" || r == "term term PCT factor") {
+    Op op = r == "term term STAR factor" ? MUL : r == "term term SLASH factor" ? DIV : MOD;
+    int x = expr(t->child(0)).first;
+    int y = expr(t->child(2)).first;
+    return make_pair(emitOp(op, x, y), INT);
+  }
+  if (r == "factor ID") {
+    Var &v = lookup(t->child(0)->lexeme);
+    if (!v.addressTaken) return make_pair(v.vreg, v.type);
+    int d = proc.newVreg();
+    emit(Ir(LDSLOT, d, -1, -1, v.slot));
+    return make_pair(d, v.type);
+  }
+  if (r == "factor NUM") return make_pair(constant((int32_t)stoll(t->child(0)->lexeme)), INT);
+  if (r == "factor NULL") return make_pair(constant(1), PTR);
+  if (r == "factor AMP lvalue") return lvalueAddress(t->child(1));
+  if (r == "factor STAR factor") {
+    int addr = expr(t->child(1)).first;
+    int d = proc.newVreg();
+    emit(Ir(LOAD, d, addr));
+    return make_pair(d, INT);
+  }
+  if (r == "factor NEW INT LBRACK expr RBRACK") {
+    usesHeap = true;
+    int n = expr(t->child(3)).first;
+    int d = proc.newVreg();
+    emit(Ir(NEW, d, n));
+    return make_pair(d, PTR);
+  }
+  if (r == "factor ID LPAREN RPAREN" || r == "factor ID LPAREN arglist RPAREN") {
+    Ir call(CALL, proc.newVreg());
+    call.callee = t->child(0)->lexeme;
+    if (t->children.size() == 4) {
+      for (Tree *a = t->child(2); ; a = a->child(2)) {
+        call.args.push_back(expr(a->child(0)).first);
+        if (a->rule == "arglist expr") break;
+      }
+    }
+    emit(call);
+    return make_pair(call.dst, INT);
+  }
+  throw runtime_error("unexpected rule in expression: " + r);
+}
+
+// Address of an lvalue, for &lvalue.
+pair<int, Type> Lowering::lvalueAddress(Tree *t) {
+  const string &r = t->rule;
+  if (r == "lvalue LPAREN lvalue RPAREN") return lvalueAddress(t->child(1));
+  if (r == "lvalue STAR factor") return make_pair(expr(t->child(1)).first, PTR);
+  Var &v = lookup(t->child(0)->lexeme);
+  int d = proc.newVreg();
+  emit(Ir(ADDR, d, -1, -1, v.slot));
+  return make_pair(d, PTR);
+}
+
+void Lowering::branchFalse(Tree *test, int label) {
+  pair<int, Type> x = expr(test->child(0));
+  pair<int, Type> y = expr(test->child(2));
+  string cmp = test->child(1)->kind;
+  Op lt = x.second == PTR ? SLTU : SLT;
+  if (cmp == "EQ") {
+    emit(Ir(BNE, -1, x.first, y.first, label));
+  } else if (cmp == "NE") {
+    emit(Ir(BEQ, -1, x.first, y.first, label));
+  } else if (cmp == "LT") {
+    emit(Ir(BEQ, -1, emitOp(lt, x.first, y.first), ZERO, label));
+  } else if (cmp == "GE") {
+    emit(Ir(BNE, -1, emitOp(lt, x.first, y.first), ZERO, label));
+  } else if (cmp == "GT") {
+    emit(Ir(BEQ, -1, emitOp(lt, y.first, x.first), ZERO, label));
+  } else {
+    emit(Ir(BNE, -1, emitOp(lt, y.first, x.first), ZERO, label));
+  }
+}
+
+void Lowering::statements(Tree *t) {
+  // statements -> statements statement is left recursive; walk it without
+  // recursing once per statement.
+  vector<Tree*> list;
+  for (; t->rule == "statements statements statement"; t = t->child(0)) list.push_back(t->child(1));
+  for (auto it = list.rbegin(); it != list.rend(); ++it) statement(*it);
+}
+
+void Lowering::statement(Tree *t) {
+  const string &r = t->rule;
+  ++proc.statements;
+  if (r == "statement lvalue BECOMES expr SEMI") {
+    int value = expr(t->child(2)).first;
+    Tree *lv = t->child(0);
+    while (lv->rule == "lvalue LPAREN lvalue RPAREN") lv = lv->child(1);
+    if (lv->rule == "lvalue ID") {
+      assignVar(lookup(lv->child(0)->lexeme), value);
+    } else {
+      int addr = expr(lv->child(1)).first;
+      emit(Ir(STORE, -1, addr, value));
+    }
+  } else if (r == "statement IF LPAREN test RPAREN LBRACE statements RBRACE ELSE LBRACE statements RBRACE") {
+    int elseLabel = proc.newLabel();
+    int endLabel = proc.newLabel();
+    branchFalse(t->child(2), elseLabel);
+    statements(t->child(5));
+    emit(Ir(JMP, -1, -1, -1, endLabel));
+    emit(Ir(LABEL, -1, -1, -1, elseLabel));
+    statements(t->child(9));
+    emit(Ir(LABEL, -1, -1, -1, endLabel));
+  } else if (r == "statement WHILE LPAREN test RPAREN LBRACE statements RBRACE") {
+    int topLabel = proc.newLabel();
+    int endLabel = proc.newLabel();
+    emit(Ir(LABEL, -1, -1, -1, topLabel));
+    branchFalse(t->child(2), endLabel);
+    statements(t->child(5));
+    emit(Ir(JMP, -1, -1, -1, topLabel));
+    emit(Ir(LABEL, -1, -1, -1, endLabel));
+  } else if (r == "statement PRINTLN LPAREN expr RPAREN SEMI") {
+    usesPrint = true;
+    emit(Ir(PRINT, -1, expr(t->child(2)).first));
+  } else if (r == "statement DELETE LBRACK RBRACK expr SEMI") {
+    usesHeap = true;
+    emit(Ir(DELETE, -1, expr(t->child(3)).first));
+  } else {
+    throw runtime_error("unexpected statement: " + r);
+  }
+}
+
+void Lowering::dcls(Tree *t) {
+  vector<Tree*> list;
+  for (; t->rule != "dcls"; t = t->child(0)) list.push_back(t);
+  for (auto it = list.rbegin(); it != list.rend(); ++it) {
+    Tree *d = *it;
+    declare(d->child(1), false, 0);
+  }
+}
+
+void Lowering::procedure(Tree *t) {
+  proc.isWain = t->kind == "main";
+  proc.name = t->child(1)->lexeme;
+
+  // Parameters and declarations first, so that address-taken variables
+  // are known before any code is generated.
+  vector<Tree*> params;
+  if (proc.isWain) {
+    params.push_back(t->child(3));
+    params.push_back(t->child(5));
+  } else if (t->child(3)->rule == "params paramlist") {
+    for (Tree *p = t->child(3)->child(0); ; p = p->child(2)) {
+      params.push_back(p->child(0));
+      if (p->rule == "paramlist dcl") break;
+    }
+  }
+  proc.nparams = proc.isWain ? 0 : params.size();
+  for (size_t i = 0; i < params.size(); ++i) {
+    declare(params[i], true, i);
+    proc.params.push_back(lookup(params[i]->child(1)->lexeme).vreg);
+  }
+  Tree *decls = t->child(proc.isWain ? 8 : 6);
+  Tree *body = t->child(proc.isWain ? 9 : 7);
+  Tree *ret = t->child(proc.isWain ? 11 : 9);
+  dcls(decls);
+  findAddressTaken(body);
+  findAddressTaken(ret);
+  for (auto &kv : vars) {
+    Var &v = kv.second;
+    if (v.addressTaken && v.slot >= 0) v.slot = proc.newSlot();
+  }
+
+  for (size_t i = 0; i < params.size(); ++i) {
+    Var &v = lookup(params[i]->child(1)->lexeme);
+    if (v.addressTaken && !proc.isWain) continue;  // already in its argument slot
+    emit(Ir(PARAM, v.vreg, -1, -1, i));
+    if (v.addressTaken) emit(Ir(STSLOT, -1, v.vreg, -1, v.slot));
+  }
+  if (proc.isWain) {
+    // The heap starts past wain's array, whose length is the second
+    // argument. Dropped again if the program never allocates.
+    Ir init(INIT, -1, ZERO, ZERO);
+    if (lookup(params[0]->child(1)->lexeme).type == PTR) {
+      init.b = lookup(params[0]->child(1)->lexeme).vreg;
+      init.a = lookup(params[1]->child(1)->lexeme).vreg;
+    }
+    emit(init);
+  }
+  vector<Tree*> list;
+  for (Tree *d = decls; d->rule != "dcls"; d = d->child(0)) list.push_back(d);
+  for (auto it = list.rbegin(); it != list.rend(); ++it) {
+    Tree *d = *it;
+    Var &v = lookup(d->child(1)->child(1)->lexeme);
+    int value = d->child(3)->kind == "NULL" ? constant(1) : constant((int32_t)stoll(d->child(3)->lexeme));
+    assignVar(v, value);
+  }
+  statements(body);
+  ++proc.statements;
+  emit(Ir(RET, -1, expr(ret).first));
+}
+
+// ---- Self tail calls ----
+
+// A call to the procedure itself whose result is returned unchanged (only
+// jumps and copies of the result lie between it and a RET) becomes an
+// assignment to the parameters and a jump back to just after they are
+// read, so tail recursion runs in constant stack. Procedures that take
+// addresses are left alone: a pointer into the old frame would see the
+// new call's variables.
+int eliminateTailCalls(Proc &proc) {
+  vector<Ir> &code = proc.code;
+  vector<int> labelAt(proc.nlabels, -1);
+  for (size_t i = 0; i < code.size(); ++i) {
+    if (code[i].op == ADDR) return 0;
+    if (code[i].op == LABEL) labelAt[code[i].imm] = i;
+  }
+  vector<size_t> tails;
+  for (size_t i = 0; i < code.size(); ++i) {
+    if (code[i].op != CALL || code[i].callee != proc.name) continue;
+    vector<int> result = {code[i].dst};
+    size_t j = i + 1;
+    for (size_t steps = 0; j < code.size() && steps < code.size(); ++steps) {
+      const Ir &ir = code[j];
+      if (ir.op == LABEL) ++j;
+      else if (ir.op == JMP) j = labelAt[ir.imm];
+      else if (ir.op == MOV && find(result.begin(), result.end(), ir.a) != result.end()) {
+        result.push_back(ir.dst);
+        ++j;
+      } else break;
+    }
+    if (j < code.size() && code[j].op == RET && find(result.begin(), result.end(), code[j].a) != result.end()) {
+      tails.push_back(i);
+    }
+  }
+  if (tails.empty()) return 0;
+
+  size_t head = 0;
+  while (head < code.size() && code[head].op == PARAM) ++head;
+  int top = proc.newLabel();
+  vector<Ir> rewritten(code.begin(), code.begin() + head);
+  rewritten.push_back(Ir(LABEL, -1, -1, -1, top));
+  size_t next = 0;
+  for (size_t i = head; i < code.size(); ++i) {
+    if (next == tails.size() || tails[next] != i) {
+      rewritten.push_back(code[i]);
+      continue;
+    }
+    ++next;
+    // Arguments that are themselves parameters are copied first so that
+    // assigning one parameter cannot clobber another's new value.
+    vector<int> args = code[i].args;
+    for (size_t k = 0; k < args.size(); ++k) {
+      auto p = find(proc.params.begin(), proc.params.end(), args[k]);
+      if (p != proc.params.end() && (size_t)(p - proc.params.begin()) != k) {
+        int t = proc.newVreg();
+        rewritten.push_back(Ir(MOV, t, args[k]));
+        args[k] = t;
+      }
+    }
+    for (size_t k = 0; k < args.size(); ++k) {
+      if (args[k] != proc.params[k]) rewritten.push_back(Ir(MOV, proc.params[k], args[k]));
+    }
+    rewritten.push_back(Ir(JMP, -1, -1, -1, top));
+  }
+  code = rewritten;
+  return tails.size();
+}
+
+// ---- SSA middle-end ----
+
+// With -O each procedure's IR is rebuilt as a control-flow graph in SSA
+// form, optimized, and lowered back to linear IR for the allocator. Block
+// terminators refer to block ids: JMP imm, BEQ/BNE imm when taken and
+// succs[1] when not, RET nothing.
+
+class SsaBlock {
+  public:
+  vector<Ir> phis;
+  vector<Ir> code;        // never empty once built: the terminator is last
+  vector<int> preds;      // phi args line up with preds
+  vector<int> succs;
+  int idom;
+  bool live;
+
+  SsaBlock() : idom(-1), live(true) {}
+  Ir &term() { return code.back(); }
+};
+
+class PassStats {
+  public:
+  string name;
+  double micros;
+  map<string, int> changes;
+
+  PassStats(string n) : name(n), micros(0) {}
+};
+
+class Ssa {
+    Proc &proc;
+    vector<SsaBlock> blocks;
+    vector<int> rpo;
+
+    int addEdgeBlock(int from, int to);
+    void removeEdge(int from, int to);
+    void computeDominators();
+    void coalesce(PassStats &st);
+    bool pure(const Ir &ir);
+    bool sideEffects(const Ir &ir);
+
+    public:
+    Ssa(Proc &p) : proc(p) {}
+    void build(PassStats &st);
+    void sccp(PassStats &st);
+    void cse(PassStats &st);
+    void dce(PassStats &st);
+    void lower(PassStats &st);
+};
+
+template<typename F> void forEachUse(Ir &ir, F f) {
+  if (ir.a > ZERO) f(ir.a);
+  if (ir.b > ZERO) f(ir.b);
+  for (int &v : ir.args) if (v > ZERO) f(v);
+}
+
+void Ssa::removeEdge(int from, int to) {
+  SsaBlock &s = blocks[to];
+  for (size_t k = 0; k < s.preds.size(); ++k) {
+    if (s.preds[k] != from) continue;
+    s.preds.erase(s.preds.begin() + k);
+    for (Ir &phi : s.phis) phi.args.erase(phi.args.begin() + k);
+    break;
+  }
+}
+
+// Reverse postorder of the reachable blocks, then immediate dominators by
+// the iterative algorithm of Cooper, Harvey and Kennedy.
+void Ssa::computeDominators() {
+  int n = blocks.size();
+  vector<int> order(n, -1), post;
+  vector<pair<int, size_t>> stack = {make_pair(0, 0)};
+  vector<bool> seen(n, false);
+  seen[0] = true;
+  while (!stack.empty()) {
+    int b = stack.back().first;
+    size_t &i = stack.back().second;
+    if (i < blocks[b].succs.size()) {
+      int s = blocks[b].succs[i++];
+      if (!seen[s]) {
+        seen[s] = true;
+        stack.push_back(make_pair(s, 0));
+      }
+    } else {
+      post.push_back(b);
+      stack.pop_back();
+    }
+  }
+  rpo.assign(post.rbegin(), post.rend());
+  for (size_t i = 0; i < rpo.size(); ++i) order[rpo[i]] = i;
+  for (int b = 0; b < n; ++b) {
+    blocks[b].idom = -1;
+    if (!seen[b] && blocks[b].live) {
+      // Unreachable: drop it and its outgoing edges.
+      for (int s : blocks[b].succs) removeEdge(b, s);
+      blocks[b].succs.clear();
+      blocks[b].live = false;
+    }
+  }
+  blocks[0].idom = 0;
+  bool changed = true;
+  while (changed) {
+    changed = false;
+    for (size_t i = 1; i < rpo.size(); ++i) {
+      int b = rpo[i];
+      int idom = -1;
+      for (int p : blocks[b].preds) {
+        if (blocks[p].idom < 0) continue;
+        if (idom < 0) { idom = p; continue; }
+        int x = p, y = idom;
+        while (x != y) {
+          while (order[x] > order[y]) x = blocks[x].idom;
+          while (order[y] > order[x]) y = blocks[y].idom;
+        }
+        idom = x;
+      }
+      if (blocks[b].idom != idom) {
+        blocks[b].idom = idom;
+        changed = true;
+      }
+    }
+  }
+}
+
+// Splits the linear IR into blocks, places phis at the iterated dominance
+// frontiers of every vreg that is live across blocks, and renames.
+void Ssa::build(PassStats &st) {
+  // Block 0 is an empty entry block so that the first real block can be
+  // a loop header.
+  blocks.assign(1, SsaBlock());
+  vector<int> blockOfLabel(proc.nlabels, -1);
+  for (const Ir &ir : proc.code) {
+    // A new block starts at a label and after a branch; consecutive
+    // labels share one block.
+    vector<Ir> &cur = blocks.back().code;
+    bool ended = !cur.empty() && cur.back().isBranch();
+    if (blocks.size() == 1 || ended || (ir.op == LABEL && !cur.empty())) blocks.push_back(SsaBlock());
+    if (ir.op == LABEL) blockOfLabel[ir.imm] = blocks.size() - 1;
+    else blocks.back().code.push_back(ir);
+  }
+  int n = blocks.size();
+  for (int b = 0; b < n; ++b) {
+    vector<Ir> &code = blocks[b].code;
+    if (code.empty() || !code.back().isBranch()) code.push_back(Ir(JMP, -1, -1, -1, b + 1));
+    else if (code.back().op != RET) code.back().imm = blockOfLabel[code.back().imm];
+    Ir &t = code.back();
+    if (t.op == JMP) blocks[b].succs = {t.imm};
+    else if (t.op != RET) blocks[b].succs = {t.imm, b + 1};
+    if (blocks[b].succs.size() == 2 && t.imm == b + 1) {
+      t = Ir(JMP, -1, -1, -1, b + 1);
+      blocks[b].succs.pop_back();
+    }
+    for (int s : blocks[b].succs) blocks[s].preds.push_back(b);
+  }
+  computeDominators();
+
+  vector<vector<int>> frontier(n);
+  for (int b = 0; b < n; ++b) {
+    if (!blocks[b].live || blocks[b].preds.size() < 2) continue;
+    for (int p : blocks[b].preds) {
+      for (int r = p; r != blocks[b].idom; r = blocks[r].idom) {
+        if (frontier[r].empty() || frontier[r].back() != b) frontier[r].push_back(b);
+      }
+    }
+  }
+
+  // Semi-pruned placement: only vregs used in some block before being
+  // defined there need phis.
+  int nv = proc.nvregs;
+  vector<bool> global(nv, false);
+  vector<vector<int>> defBlocks(nv);
+  vector<int> definedIn(nv, -1);
+  for (int b = 0; b < n; ++b) {
+    if (!blocks[b].live) continue;
+    for (Ir &ir : blocks[b].code) {
+      forEachUse(ir, [&](int &v) { if (definedIn[v] != b) global[v] = true; });
+      int d = ir.def();
+      if (d >= 0 && definedIn[d] != b) {
+        definedIn[d] = b;
+        defBlocks[d].push_back(b);
+      }
+    }
+  }
+  vector<int> hasPhi(n, -1);
+  int phis = 0;
+  for (int v = 1; v < nv; ++v) {
+    if (!global[v]) continue;
+    vector<int> work = defBlocks[v];
+    while (!work.empty()) {
+      int b = work.back();
+      work.pop_back();
+      for (int d : frontier[b]) {
+        if (hasPhi[d] == v) continue;
+        hasPhi[d] = v;
+        Ir phi(PHI, v, -1, -1, v);   // imm remembers the original vreg
+        phi.args.assign(blocks[d].preds.size(), v);
+        blocks[d].phis.push_back(phi);
+        ++phis;
+        work.push_back(d);
+      }
+    }
+  }
+
+  // Rename along the dominator tree, iteratively since straight-line
+  // sequences of ifs make it as deep as the procedure is long.
+  vector<vector<int>> children(n);
+  for (int b = 1; b < n; ++b) if (blocks[b].live) children[blocks[b].idom].push_back(b);
+  vector<vector<int>> names(nv);
+  auto top = [&](int v) { return names[v].empty() ? ZERO : names[v].back(); };
+  vector<pair<int, vector<int>>> stack;   // block, original vregs it pushed
+  stack.push_back(make_pair(0, vector<int>()));
+  vector<bool> entered(n, false);
+  while (!stack.empty()) {
+    int b = stack.back().first;
+    if (entered[b]) {
+      for (int v : stack.back().second) names[v].pop_back();
+      stack.pop_back();
+      continue;
+    }
+    entered[b] = true;
+    vector<int> &pushed = stack.back().second;
+    SsaBlock &blk = blocks[b];
+    for (Ir &phi : blk.phis) {
+      int v = phi.dst;
+      phi.dst = proc.newVreg();
+      names[v].push_back(phi.dst);
+      pushed.push_back(v);
+    }
+    for (Ir &ir : blk.code) {
+      forEachUse(ir, [&](int &v) { v = top(v); });
+      int d = ir.def();
+      if (d >= 0) {
+        ir.dst = proc.newVreg();
+        names[d].push_back(ir.dst);
+        pushed.push_back(d);
+      }
+    }
+    for (int s : blk.succs) {
+      for (size_t k = 0; k < blocks[s].preds.size(); ++k) {
+        if (blocks[s].preds[k] != b) continue;
+        for (Ir &phi : blocks[s].phis) phi.args[k] = top(phi.imm);
+      }
+    }
+    vector<int> kids = children[b];
+    for (auto it = kids.rbegin(); it != kids.rend(); ++it) stack.push_back(make_pair(*it, vector<int>()));
+  }
+  st.changes["blocks"] += n;
+  st.changes["phis"] += phis;
+}
+
+// Sparse conditional constant propagation (Wegman and Zadeck).
+void Ssa::sccp(PassStats &st) {
+  enum { TOP, CONSTANT, BOTTOM };
+  int nv = proc.nvregs, n = blocks.size();
+  vector<int> lat(nv, TOP);
+  vector<int32_t> val(nv, 0);
+  lat[ZERO] = CONSTANT;
+
+  // Where each vreg is used: block and instruction, phis as -(k+1).
+  vector<vector<pair<int, int>>> useSites(nv);
+  for (int b = 0; b < n; ++b) {
+    if (!blocks[b].live) continue;
+    for (size_t k = 0; k < blocks[b].phis.size(); ++k) {
+      forEachUse(blocks[b].phis[k], [&](int &v) { useSites[v].push_back(make_pair(b, -(int)k - 1)); });
+    }
+    for (size_t i = 0; i < blocks[b].code.size(); ++i) {
+      forEachUse(blocks[b].code[i], [&](int &v) { useSites[v].push_back(make_pair(b, i)); });
+    }
+  }
+
+  vector<vector<bool>> edgeExec(n);
+  for (int b = 0; b < n; ++b) edgeExec[b].assign(blocks[b].preds.size(), false);
+  vector<bool> visited(n, false);
+  vector<pair<int, int>> flowWork = {make_pair(-1, 0)};
+  vector<int> ssaWork;
+
+  auto meet = [&](int v, int l, int32_t c) {
+    if (v <= ZERO || lat[v] == BOTTOM) return;
+    if (lat[v] == CONSTANT && (l == TOP || (l == CONSTANT && c == val[v]))) return;
+    if (lat[v] == CONSTANT && l == CONSTANT) l = BOTTOM;
+    if (l == lat[v]) return;
+    lat[v] = l;
+    val[v] = c;
+    ssaWork.push_back(v);
+  };
+  auto visitPhi = [&](int b, Ir &phi) {
+    int l = TOP;
+    int32_t c = 0;
+    for (size_t k = 0; k < phi.args.size() && l != BOTTOM; ++k) {
+      if (!edgeExec[b][k]) continue;
+      int a = phi.args[k];
+      if (lat[a] == TOP) continue;
+      if (lat[a] == BOTTOM || (l == CONSTANT && val[a] != c)) l = BOTTOM;
+      else { l = CONSTANT; c = val[a]; }
+    }
+    meet(phi.dst, l, c);
+  };
+  auto visit = [&](int b, Ir &ir) {
+    int x = ir.a > ZERO ? ir.a : ZERO, y = ir.b > ZERO ? ir.b : ZERO;
+    switch (ir.op) {
+    case CONST:
+      meet(ir.dst, CONSTANT, ir.imm);
+      break;
+    case MOV:
+      meet(ir.dst, lat[x], val[x]);
+      break;
+    case ADD: case SUB: case MUL: case DIV: case MOD: case SLT: case SLTU: {
+      if (lat[x] == BOTTOM || lat[y] == BOTTOM) { meet(ir.dst, BOTTOM, 0); break; }
+      if (lat[x] == TOP || lat[y] == TOP) break;
+      uint32_t p = val[x], q = val[y];
+      int32_t r;
+      if (ir.op == ADD) r = p + q;
+      else if (ir.op == SUB) r = p - q;
+      else if (ir.op == MUL) r = p * q;
+      else if (ir.op == SLT) r = val[x] < val[y];
+      else if (ir.op == SLTU) r = p < q;
+      else if (q == 0 || (val[x] == INT32_MIN && val[y] == -1)) { meet(ir.dst, BOTTOM, 0); break; }
+      else r = ir.op == DIV ? val[x] / val[y] : val[x] % val[y];
+      meet(ir.dst, CONSTANT, r);
+      break;
+    }
+    case JMP:
+      flowWork.push_back(make_pair(b, ir.imm));
+      break;
+    case BEQ: case BNE:
+      if (lat[x] == TOP || lat[y] == TOP) break;
+      if (lat[x] == CONSTANT && lat[y] == CONSTANT) {
+        bool taken = (val[x] == val[y]) == (ir.op == BEQ);
+        flowWork.push_back(make_pair(b, blocks[b].succs[taken ? 0 : 1]));
+      } else {
+        flowWork.push_back(make_pair(b, blocks[b].succs[0]));
+        flowWork.push_back(make_pair(b, blocks[b].succs[1]));
+      }
+      break;
+    default:
+      if (ir.def() >= 0) meet(ir.dst, BOTTOM, 0);
+      break;
+    }
+  };
+
+  while (!flowWork.empty() || !ssaWork.empty()) {
+    if (!flowWork.empty()) {
+      int from = flowWork.back().first, to = flowWork.back().second;
+      flowWork.pop_back();
+      if (from >= 0) {
+        bool fresh = false;
+        for (size_t k = 0; k < blocks[to].preds.size(); ++k) {
+          if (blocks[to].preds[k] == from && !edgeExec[to][k]) edgeExec[to][k] = fresh = true;
+        }
+        if (!fresh) continue;
+      }
+      for (Ir &phi : blocks[to].phis) visitPhi(to, phi);
+      if (!visited[to]) {
+        visited[to] = true;
+        for (Ir &ir : blocks[to].code) visit(to, ir);
+      }
+    } else {
+      int v = ssaWork.back();
+      ssaWork.pop_back();
+      for (auto &site : useSites[v]) {
+        int b = site.first;
+        if (!visited[b]) continue;
+        if (site.second < 0) visitPhi(b, blocks[b].phis[-site.second - 1]);
+        else visit(b, blocks[b].code[site.second]);
+      }
+    }
+  }
+
+  // Rewrite: constant values become CONST, known branches become jumps
+  // and blocks never reached are dropped.
+  for (int b = 0; b < n; ++b) {
+    SsaBlock &blk = blocks[b];
+    if (!blk.live) continue;
+    if (!visited[b]) {
+      for (int s : blk.succs) removeEdge(b, s);
+      blk.succs.clear();
+      blk.live = false;
+      st.changes["unreachable blocks"]++;
+      continue;
+    }
+    vector<Ir> consts;
+    vector<Ir> phis;
+    for (Ir &phi : blk.phis) {
+      if (lat[phi.dst] == CONSTANT) {
+        consts.push_back(Ir(CONST, phi.dst, -1, -1, val[phi.dst]));
+        st.changes["constants"]++;
+      } else {
+        phis.push_back(phi);
+      }
+    }
+    blk.phis = phis;
+    for (Ir &ir : blk.code) {
+      bool foldable = ir.op == MOV || (ir.op >= ADD && ir.op <= SLTU);
+      if (foldable && lat[ir.dst] == CONSTANT) {
+        ir = Ir(CONST, ir.dst, -1, -1, val[ir.dst]);
+        st.changes["constants"]++;
+      }
+      forEachUse(ir, [&](int &v) { if (lat[v] == CONSTANT && val[v] == 0) v = ZERO; });
+    }
+    blk.code.insert(blk.code.begin(), consts.begin(), consts.end());
+    Ir &t = blk.term();
+    if ((t.op == BEQ || t.op == BNE) && lat[t.a > ZERO ? t.a : ZERO] == CONSTANT && lat[t.b > ZERO ? t.b : ZERO] == CONSTANT) {
+      bool taken = (val[t.a > ZERO ? t.a : ZERO] == val[t.b > ZERO ? t.b : ZERO]) == (t.op == BEQ);
+      int keep = blk.succs[taken ? 0 : 1], drop = blk.succs[taken ? 1 : 0];
+      removeEdge(b, drop);
+      blk.succs = {keep};
+      t = Ir(JMP, -1, -1, -1, keep);
+      st.changes["branches"]++;
+    }
+  }
+  for (int b = 0; b < n; ++b) {
+    for (Ir &phi : blocks[b].phis) {
+      forEachUse(phi, [&](int &v) { if (lat[v] == CONSTANT && val[v] == 0) v = ZERO; });
+    }
+  }
+  computeDominators();
+}
+
+bool Ssa::pure(const Ir &ir) {
+  return ir.op == CONST || ir.op == ADDR || (ir.op >= ADD && ir.op <= SLTU);
+}
+
+// Common subexpression elimination and copy propagation over the
+// dominator tree: an expression computed in a dominating block is reused.
+void Ssa::cse(PassStats &st) {
+  int n = blocks.size();
+  vector<int> repl(proc.nvregs);
+  for (size_t v = 0; v < repl.size(); ++v) repl[v] = v;
+  auto find = [&](int v) {
+    while (repl[v] != v) v = repl[v];
+    return v;
+  };
+  vector<vector<int>> children(n);
+  for (int b = 1; b < n; ++b) if (blocks[b].live) children[blocks[b].idom].push_back(b);
+  map<array<int, 4>, int> table;
+  vector<pair<int, vector<array<int, 4>>>> stack = {make_pair(0, vector<array<int, 4>>())};
+  vector<bool> entered(n, false);
+  while (!stack.empty()) {
+    int b = stack.back().first;
+    if (entered[b]) {
+      for (auto &key : stack.back().second) table.erase(key);
+      stack.pop_back();
+      continue;
+    }
+    entered[b] = true;
+    vector<array<int, 4>> &added = stack.back().second;
+    vector<Ir> kept;
+    for (Ir &ir : blocks[b].code) {
+      forEachUse(ir, [&](int &v) { v = find(v); });
+      if (ir.op == MOV) {
+        repl[ir.dst] = ir.a > ZERO ? ir.a : ZERO;
+        st.changes["copies"]++;
+        continue;
+      }
+      if (pure(ir)) {
+        int x = ir.a, y = ir.b;
+        if ((ir.op == ADD || ir.op == MUL) && x > y) swap(x, y);
+        array<int, 4> key = {ir.op, x, y, ir.imm};
+        auto it = table.find(key);
+        if (it != table.end()) {
+          repl[ir.dst] = it->second;
+          st.changes["expressions"]++;
+          continue;
+        }
+        table[key] = ir.dst;
+        added.push_back(key);
+      }
+      kept.push_back(ir);
+    }
+    blocks[b].code = kept;
+    vector<int> kids = children[b];
+    for (auto it = kids.rbegin(); it != kids.rend(); ++it) stack.push_back(make_pair(*it, vector<array<int, 4>>()));
+  }
+  // Phi arguments flow in along back edges, so resolve them last.
+  for (SsaBlock &blk : blocks) {
+    for (Ir &phi : blk.phis) forEachUse(phi, [&](int &v) { v = find(v); });
+  }
+}
+
+bool Ssa::sideEffects(const Ir &ir) {
+  switch (ir.op) {
+  case STORE: case STSLOT: case CALL: case PRINT: case NEW: case DELETE: case INIT:
+  case LOAD: case JMP: case BEQ: case BNE: case RET:
+    return true;
+  default:
+    return false;
+  }
+}
+
+// Mark-and-sweep dead code elimination. Division is kept unless its
+// divisor is a nonzero constant, since dividing by zero traps; that is
+// decided while marking, as the sweep rewrites the blocks that defOf
+// points into.
+void Ssa::dce(PassStats &st) {
+  int n = blocks.size();
+  vector<Ir*> defOf(proc.nvregs, nullptr);
+  for (SsaBlock &blk : blocks) {
+    if (!blk.live) continue;
+    for (Ir &phi : blk.phis) defOf[phi.dst] = &phi;
+    for (Ir &ir : blk.code) if (ir.def() >= 0) defOf[ir.dst] = &ir;
+  }
+  vector<bool> live(proc.nvregs, false);
+  vector<int> work;
+  auto need = [&](Ir &ir) {
+    forEachUse(ir, [&](int &v) {
+      if (!live[v]) { live[v] = true; work.push_back(v); }
+    });
+  };
+  for (SsaBlock &blk : blocks) {
+    if (!blk.live) continue;
+    for (Ir &ir : blk.code) {
+      bool trap = false;
+      if (ir.op == DIV || ir.op == MOD) {
+        Ir *d = ir.b > ZERO ? defOf[ir.b] : nullptr;
+        trap = !(d && d->op == CONST && d->imm != 0);
+      }
+      if (sideEffects(ir) || trap) {
+        // A trapping division's result is marked live so the sweep keeps it.
+        if (ir.def() >= 0) live[ir.dst] = true;
+        need(ir);
+      }
+    }
+  }
+  while (!work.empty()) {
+    int v = work.back();
+    work.pop_back();
+    if (defOf[v]) need(*defOf[v]);
+  }
+  for (int b = 0; b < n; ++b) {
+    SsaBlock &blk = blocks[b];
+    vector<Ir> phis, code;
+    for (Ir &phi : blk.phis) {
+      if (live[phi.dst]) phis.push_back(phi);
+      else st.changes["phis"]++;
+    }
+    for (Ir &ir : blk.code) {
+      if (ir.def() < 0 || live[ir.dst] || sideEffects(ir)) code.push_back(ir);
+      else st.changes["instructions"]++;
+    }
+    blk.phis = phis;
+    blk.code = code;
+  }
+}
+
+// Gives each phi and its arguments one vreg when their live ranges do
+// not overlap, so that the copies out of SSA mostly disappear (Budimlic
+// et al., "Fast copy coalescing and live-range identification"). Two SSA
+// values interfere when one is live where the other is defined.
+void Ssa::coalesce(PassStats &st) {
+  int n = blocks.size(), nv = proc.nvregs;
+  vector<int> defBlock(nv, -1), defPos(nv, 0);
+  for (int b = 0; b < n; ++b) {
+    if (!blocks[b].live) continue;
+    for (Ir &phi : blocks[b].phis) { defBlock[phi.dst] = b; defPos[phi.dst] = -1; }
+    for (size_t i = 0; i < blocks[b].code.size(); ++i) {
+      int d = blocks[b].code[i].def();
+      if (d >= 0) { defBlock[d] = b; defPos[d] = i; }
+    }
+  }
+  vector<vector<bool>> liveOut(n, vector<bool>(nv, false)), liveIn = liveOut;
+  bool changed = true;
+  while (changed) {
+    changed = false;
+    for (int b = n - 1; b >= 0; --b) {
+      SsaBlock &blk = blocks[b];
+      if (!blk.live) continue;
+      vector<bool> out(nv, false);
+      for (int s : blk.succs) {
+        for (int v = 0; v < nv; ++v) if (liveIn[s][v]) out[v] = true;
+        for (size_t k = 0; k < blocks[s].preds.size(); ++k) {
+          if (blocks[s].preds[k] != b) continue;
+          for (Ir &phi : blocks[s].phis) if (phi.args[k] > ZERO) out[phi.args[k]] = true;
+        }
+      }
+      vector<bool> in = out;
+      for (auto it = blk.code.rbegin(); it != blk.code.rend(); ++it) {
+        if (it->def() >= 0) in[it->dst] = false;
+        forEachUse(*it, [&](int &v) { in[v] = true; });
+      }
+      for (Ir &phi : blk.phis) in[phi.dst] = false;
+      if (out != liveOut[b] || in != liveIn[b]) {
+        liveOut[b] = out;
+        liveIn[b] = in;
+        changed = true;
+      }
+    }
+  }
+  // Preorder numbering of the dominator tree answers "does a dominate b".
+  vector<vector<int>> children(n);
+  for (int b = 1; b < n; ++b) if (blocks[b].live) children[blocks[b].idom].push_back(b);
+  vector<int> pre(n, 0), last(n, 0);
+  vector<pair<int, size_t>> stack = {make_pair(0, 0)};
+  int counter = 0;
+  pre[0] = counter++;
+  while (!stack.empty()) {
+    int b = stack.back().first;
+    size_t &i = stack.back().second;
+    if (i < children[b].size()) {
+      int c = children[b][i++];
+      pre[c] = counter++;
+      stack.push_back(make_pair(c, 0));
+    } else {
+      last[b] = counter - 1;
+      stack.pop_back();
+    }
+  }
+  auto dominates = [&](int x, int y) {   // def of x dominates def of y
+    int bx = defBlock[x], by = defBlock[y];
+    if (bx == by) return defPos[x] < defPos[y];
+    return pre[bx] < pre[by] && pre[by] <= last[bx];
+  };
+  auto liveAt = [&](int x, int y) {      // x live just after y's def
+    int b = defBlock[y];
+    if (liveOut[b][x]) return true;
+    vector<Ir> &code = blocks[b].code;
+    for (size_t i = defPos[y] + 1; i < code.size(); ++i) {
+      bool used = false;
+      forEachUse(code[i], [&](int &v) { if (v == x) used = true; });
+      if (used) return true;
+    }
+    return false;
+  };
+  auto interfere = [&](int x, int y) {
+    if (defBlock[x] < 0 || defBlock[y] < 0) return true;
+    if (defBlock[x] == defBlock[y] && defPos[x] == -1 && defPos[y] == -1) return true;
+    if (dominates(x, y)) return liveAt(x, y);
+    if (dominates(y, x)) return liveAt(y, x);
+    return false;
+  };
+
+  vector<int> rep(nv);
+  vector<vector<int>> members(nv);
+  for (int v = 0; v < nv; ++v) { rep[v] = v; members[v] = {v}; }
+  for (int b = 0; b < n; ++b) {
+    if (!blocks[b].live) continue;
+    for (Ir &phi : blocks[b].phis) {
+      for (int a : phi.args) {
+        int x = rep[phi.dst], y = rep[a];
+        if (a <= ZERO || x == y) continue;
+        bool clash = false;
+        for (int m1 : members[x]) {
+          for (int m2 : members[y]) if (interfere(m1, m2)) { clash = true; break; }
+          if (clash) break;
+        }
+        if (clash) continue;
+        for (int m : members[y]) { rep[m] = x; members[x].push_back(m); }
+        members[y].clear();
+        st.changes["coalesced"]++;
+      }
+    }
+  }
+  for (SsaBlock &blk : blocks) {
+    for (Ir &phi : blk.phis) {
+      phi.dst = rep[phi.dst];
+      forEachUse(phi, [&](int &v) { v = rep[v]; });
+    }
+    for (Ir &ir : blk.code) {
+      if (ir.def() >= 0) ir.dst = rep[ir.dst];
+      forEachUse(ir, [&](int &v) { v = rep[v]; });
+    }
+  }
+}
+
+// New block on the edge from -> to, which then jumps to to.
+int Ssa::addEdgeBlock(int from, int to) {
+  int e = blocks.size();
+  blocks.push_back(SsaBlock());
+  SsaBlock &blk = blocks[e];
+  blk.code.push_back(Ir(JMP, -1, -1, -1, to));
+  blk.preds = {from};
+  blk.succs = {to};
+  blk.idom = from;
+  for (int &s : blocks[from].succs) {
+    if (s == to) { s = e; break; }
+  }
+  Ir &t = blocks[from].term();
+  if (t.imm == to && blocks[from].succs[0] == e) t.imm = e;
+  for (int &p : blocks[to].preds) {
+    if (p == from) { p = e; break; }
+  }
+  return e;
+}
+
+// Out of SSA: critical edges are split, each phi becomes a parallel copy
+// at the end of its predecessors, and the blocks are laid out in their
+// original order with jumps to the next block left out.
+void Ssa::lower(PassStats &st) {
+  int n = blocks.size();
+  vector<int> after(n, -1);      // edge block to place right after a block
+  for (int b = 0; b < n; ++b) {
+    if (!blocks[b].live || blocks[b].phis.empty() || blocks[b].preds.size() < 2) continue;
+    vector<int> preds = blocks[b].preds;
+    for (int p : preds) {
+      if (blocks[p].succs.size() < 2) continue;
+      int e = addEdgeBlock(p, b);
+      if (blocks[p].succs[1] == e) after[p] = e;
+      st.changes["split edges"]++;
+    }
+  }
+  coalesce(st);
+  for (size_t b = 0; b < blocks.size(); ++b) {
+    SsaBlock &blk = blocks[b];
+    if (!blk.live || blk.phis.empty()) continue;
+    for (size_t k = 0; k < blk.preds.size(); ++k) {
+      vector<pair<int, int>> copies;   // dst, src
+      for (Ir &phi : blk.phis) {
+        int src = phi.args[k] > ZERO ? phi.args[k] : ZERO;
+        if (src != phi.dst) copies.push_back(make_pair(phi.dst, src));
+      }
+      vector<Ir> seq;
+      while (!copies.empty()) {
+        size_t i = 0;
+        for (; i < copies.size(); ++i) {
+          bool blocked = false;
+          for (size_t j = 0; j < copies.size(); ++j) if (j != i && copies[j].second == copies[i].first) blocked = true;
+          if (!blocked) break;
+        }
+        if (i == copies.size()) {
+          // A cycle: save one destination and read it from the copy.
+          int t = proc.newVreg();
+          seq.push_back(Ir(MOV, t, copies[0].first));
+          for (auto &c : copies) if (c.second == copies[0].first) c.second = t;
+          st.changes["cycle temps"]++;
+          continue;
+        }
+        seq.push_back(Ir(MOV, copies[i].first, copies[i].second));
+        copies.erase(copies.begin() + i);
+      }
+      vector<Ir> &code = blocks[blk.preds[k]].code;
+      code.insert(code.end() - 1, seq.begin(), seq.end());
+      st.changes["copies"] += seq.size();
+    }
+    blk.phis.clear();
+  }
+
+  vector<int> layout;
+  for (int b = 0; b < n; ++b) {
+    if (!blocks[b].live) continue;
+    layout.push_back(b);
+    if (after[b] >= 0) layout.push_back(after[b]);
+  }
+  for (size_t e = n; e < blocks.size(); ++e) {
+    if (find(layout.begin(), layout.end(), (int)e) == layout.end()) layout.push_back(e);
+  }
+  vector<Ir> code;
+  vector<bool> target(blocks.size(), false);
+  for (size_t i = 0; i < layout.size(); ++i) {
+    SsaBlock &blk = blocks[layout[i]];
+    int next = i + 1 < layout.size() ? layout[i + 1] : -1;
+    code.push_back(Ir(LABEL, -1, -1, -1, layout[i]));
+    code.insert(code.end(), blk.code.begin(), blk.code.end() - 1);
+    Ir t = blk.term();
+    if (t.op == JMP) {
+      if (t.imm != next) code.push_back(t);
+    } else if (t.op == BEQ || t.op == BNE) {
+      int fall = blk.succs[1];
+      if (t.imm == next) {
+        t.op = t.op == BEQ ? BNE : BEQ;
+        t.imm = fall;
+        code.push_back(t);
+      } else {
+        code.push_back(t);
+        if (fall != next) code.push_back(Ir(JMP, -1, -1, -1, fall));
+      }
+    } else {
+      code.push_back(t);
+    }
+  }
+  for (Ir &ir : code) if (ir.op == JMP || ir.op == BEQ || ir.op == BNE) target[ir.imm] = true;
+  proc.code.clear();
+  for (Ir &ir : code) if (ir.op != LABEL || target[ir.imm]) proc.code.push_back(ir);
+  proc.nlabels = blocks.size();
+}
+
+class Optimizer {
+    vector<PassStats> passes;
+
+    template<typename F> void timed(size_t i, F f) {
+      auto begin = chrono::steady_clock::now();
+      f(passes[i]);
+      passes[i].micros += chrono::duration<double, micro>(chrono::steady_clock::now() - begin).count();
+    }
+
+    public:
+    Optimizer() {
+      for (string name : {"ssa", "sccp", "cse", "dce", "out-of-ssa"}) passes.push_back(PassStats(name));
+    }
+    void run(Proc &proc) {
+      Ssa ssa(proc);
+      timed(0, [&](PassStats &st) { ssa.build(st); });
+      timed(1, [&](PassStats &st) { ssa.sccp(st); });
+      timed(2, [&](PassStats &st) { ssa.cse(st); });
+      timed(3, [&](PassStats &st) { ssa.dce(st); });
+      timed(4, [&](PassStats &st) { ssa.lower(st); });
+    }
+    void report(ostream &out) {
+      for (const PassStats &p : passes) {
+        out << p.name << " (" << p.micros << " us):";
+        if (p.changes.empty()) out << " no changes";
+        for (auto &c : p.changes) out << " " << c.second << " " << c.first;
+        out << endl;
+      }
+    }
+};
+
+// ---- Liveness and linear-scan register allocation ----
+
+// Registers handed out by the allocator. $1-$3 carry runtime arguments and
+// results, $26-$28 are scratch for spill code and call sequences, $29 is
+// the frame pointer, $30 the stack pointer and $31 the return address.
+// Procedures preserve $15-$25 for their callers; $4-$14 are saved around
+// calls by the caller when something lives across them.
+const int FIRST_CALLEE_SAVED = 15;
+
+vector<int> allocatable() {
+  vector<int> regs;
+  for (int r = 4; r <= 25; ++r) regs.push_back(r);
+  return regs;
+}
+
+bool calleeSaved(int r) {
+  return r >= FIRST_CALLEE_SAVED && r <= 25;
+}
+
+class Block {
+  public:
+  int first, last;         // instruction range, inclusive
+  vector<int> succ;
+  vector<bool> liveIn, liveOut;
+};
+
+vector<Block> buildBlocks(const Proc &proc) {
+  vector<Block> blocks;
+  const vector<Ir> &code = proc.code;
+  int n = code.size();
+  vector<int> blockOfLabel(proc.nlabels, -1);
+  for (int i = 0; i < n; ++i) {
+    bool leader = i == 0 || code[i].op == LABEL || code[i - 1].isBranch();
+    if (leader) {
+      if (!blocks.empty()) blocks.back().last = i - 1;
+      blocks.push_back(Block());
+      blocks.back().first = i;
+    }
+    if (code[i].op == LABEL) blockOfLabel[code[i].imm] = blocks.size() - 1;
+  }
+  if (!blocks.empty()) blocks.back().last = n - 1;
+  for (size_t b = 0; b < blocks.size(); ++b) {
+    const Ir &last = code[blocks[b].last];
+    if (last.op == JMP || last.op == BEQ || last.op == BNE) blocks[b].succ.push_back(blockOfLabel[last.imm]);
+    if (last.op != JMP && last.op != RET && b + 1 < blocks.size()) blocks[b].succ.push_back(b + 1);
+  }
+  return blocks;
+}
+
+void computeLiveness(const Proc &proc, vector<Block> &blocks) {
+  int nv = proc.nvregs;
+  vector<vector<bool>> use(blocks.size(), vector<bool>(nv)), def(blocks.size(), vector<bool>(nv));
+  for (size_t b = 0; b < blocks.size(); ++b) {
+    for (int i = blocks[b].first; i <= blocks[b].last; ++i) {
+      for (int u : proc.code[i].uses()) if (!def[b][u]) use[b][u] = true;
+      int d = proc.code[i].def();
+      if (d >= 0) def[b][d] = true;
+    }
+    blocks[b].liveIn.assign(nv, false);
+    blocks[b].liveOut.assign(nv, false);
+  }
+  bool changed = true;
+  while (changed) {
+    changed = false;
+    for (int b = blocks.size() - 1; b >= 0; --b) {
+      vector<bool> out(nv, false);
+      for (int s : blocks[b].succ) {
+        for (int v = 0; v < nv; ++v) if (blocks[s].liveIn[v]) out[v] = true;
+      }
+      vector<bool> in(nv);
+      for (int v = 0; v < nv; ++v) in[v] = use[b][v] || (out[v] && !def[b][v]);
+      if (in != blocks[b].liveIn || out != blocks[b].liveOut) {
+        blocks[b].liveIn = in;
+        blocks[b].liveOut = out;
+        changed = true;
+      }
+    }
+  }
+}
+
+// Live intervals are the hull of every position a vreg is live at.
+void computeIntervals(Proc &proc, const vector<Block> &blocks) {
+  int nv = proc.nvregs;
+  proc.start.assign(nv, INT32_MAX);
+  proc.end.assign(nv, -1);
+  auto extend = [&](int v, int pos) {
+    proc.start[v] = min(proc.start[v], pos);
+    proc.end[v] = max(proc.end[v], pos);
+  };
+  for (const Block &b : blocks) {
+    for (int v = 1; v < nv; ++v) {
+      if (b.liveIn[v]) extend(v, b.first);
+      if (b.liveOut[v]) extend(v, b.last);
+    }
+    for (int i = b.first; i <= b.last; ++i) {
+      for (int u : proc.code[i].uses()) extend(u, i);
+      int d = proc.code[i].def();
+      if (d >= 0) extend(d, i);
+    }
+  }
+}
+
+void allocateRegisters(Proc &proc, const vector<int> &pool) {
+  vector<Block> blocks = buildBlocks(proc);
+  computeLiveness(proc, blocks);
+  computeIntervals(proc, blocks);
+
+  int nv = proc.nvregs;
+  proc.regOf.assign(nv, -1);
+  proc.slotOf.assign(nv, -1);
+  proc.regOf[ZERO] = 0;
+  auto spill = [&](int v) {
+    proc.regOf[v] = -1;
+    proc.slotOf[v] = proc.newSlot();
+  };
+
+  // Values that live across several calls go in callee-saved registers,
+  // which cost one save and restore per invocation however many calls
+  // they cross. In a caller-saved register they cost a save and a restore
+  // per call, paid only on paths that make the call, which is no worse
+  // for a value crossing a single call. Values that would cross more
+  // calls than they have references are cheaper kept in their stack
+  // slot than in a caller-saved register.
+  vector<int> callsBefore(proc.code.size() + 1, 0);
+  vector<int> refs(nv, 0);
+  for (size_t i = 0; i < proc.code.size(); ++i) {
+    callsBefore[i + 1] = callsBefore[i] + proc.code[i].isCall();
+    for (int u : proc.code[i].uses()) ++refs[u];
+    if (proc.code[i].def() >= 0) ++refs[proc.code[i].def()];
+  }
+  vector<int> order, crossed(nv, 0);
+  for (int v = 1; v < nv; ++v) {
+    if (proc.end[v] < 0) continue;
+    crossed[v] = callsBefore[proc.end[v]] - callsBefore[proc.start[v] + 1];
+    order.push_back(v);
+  }
+  stable_sort(order.begin(), order.end(), [&](int a, int b) { return proc.start[a] < proc.start[b]; });
+
+  vector<int> callerFree, calleeFree;
+  for (auto it = pool.rbegin(); it != pool.rend(); ++it) (calleeSaved(*it) ? calleeFree : callerFree).push_back(*it);
+  auto release = [&](int r) { (calleeSaved(r) ? calleeFree : callerFree).push_back(r); };
+  auto acceptable = [&](int v, int r) { return calleeSaved(r) || 2 * crossed[v] <= refs[v]; };
+  vector<int> active;  // sorted by increasing end
+  for (int v : order) {
+    // Expire intervals that ended before this one starts.
+    while (!active.empty() && proc.end[active.front()] < proc.start[v]) {
+      release(proc.regOf[active.front()]);
+      active.erase(active.begin());
+    }
+    vector<int> &prefer = crossed[v] > 1 ? calleeFree : callerFree;
+    vector<int> &other = crossed[v] > 1 ? callerFree : calleeFree;
+    if (!prefer.empty()) {
+      proc.regOf[v] = prefer.back();
+      prefer.pop_back();
+    } else if (!other.empty() && acceptable(v, other.back())) {
+      proc.regOf[v] = other.back();
+      other.pop_back();
+    } else if (!active.empty() && proc.end[active.back()] > proc.end[v] &&
+               acceptable(v, proc.regOf[active.back()])) {
+      // Spill whichever interval reaches furthest.
+      int victim = active.back();
+      active.pop_back();
+      proc.regOf[v] = proc.regOf[victim];
+      spill(victim);
+    } else {
+      spill(v);
+      continue;
+    }
+    auto pos = upper_bound(active.begin(), active.end(), v,
+                           [&](int a, int b) { return proc.end[a] < proc.end[b]; });
+    active.insert(pos, v);
+  }
+}
+
+// ---- MIPS emission ----
+
+class Emitter {
+    Proc &proc;
+    vector<string> &out;
+    vector<int> saveSlot;   // caller-save slot per machine register
+    vector<pair<int, int>> calleeSaves;  // register, slot
+    bool &leaf;
+    bool &frameless;
+
+    string reg(int r) { return "$" + to_string(r); }
+    string label(int l) { return "L" + proc.name + "Z" + to_string(l); }
+    int offset(int slot) {
+      if (slot < 0) return 4 * slot;                // incoming argument
+      return -4 * (proc.nparams + 3 + slot);        // past saved $31 and $29
+    }
+    void line(const string &s) { out.push_back(s); }
+    void loadConst(const string &r, int32_t v) {
+      if (v == 0) { line("add " + r + ", $0, $0"); return; }
+      line("lis " + r);
+      line(".word " + to_string(v));
+    }
+    // Register holding vreg v for reading; spilled vregs are loaded into
+    // the given scratch register.
+    string use(int v, int scratch) {
+      if (proc.regOf[v] >= 0) return reg(proc.regOf[v]);
+      line("lw " + reg(scratch) + ", " + to_string(offset(proc.slotOf[v])) + "($29)");
+      return reg(scratch);
+    }
+    string def(int v) {
+      return proc.regOf[v] >= 0 ? reg(proc.regOf[v]) : "$26";
+    }
+    void commit(int v) {
+      if (proc.regOf[v] < 0) line("sw $26, " + to_string(offset(proc.slotOf[v])) + "($29)");
+    }
+    void move(int d, const string &src) {
+      string r = def(d);
+      if (r != src) line("add " + r + ", " + src + ", $0");
+      commit(d);
+    }
+    void callRuntime(const string &name) {
+      line("lis $28");
+      line(".word " + name);
+      line("jalr $28");
+    }
+    vector<int> liveAcross(int pos);
+    void instruction(int pos);
+
+    public:
+    Emitter(Proc &p, vector<string> &o) : proc(p), out(o), leaf(p.leaf), frameless(p.frameless) {}
+    void emit();
+};
+
+// Registers whose vreg is live both before and after position pos.
+vector<int> Emitter::liveAcross(int pos) {
+  vector<int> regs;
+  for (int v = 1; v < proc.nvregs; ++v) {
+    int r = proc.regOf[v];
+    if (r > 0 && !calleeSaved(r) && proc.start[v] < pos && proc.end[v] > pos) regs.push_back(r);
+  }
+  sort(regs.begin(), regs.end());
+  regs.erase(unique(regs.begin(), regs.end()), regs.end());
+  return regs;
+}
+
+void Emitter::instruction(int pos) {
+  const Ir &ir = proc.code[pos];
+  switch (ir.op) {
+  case CONST:
+    loadConst(def(ir.dst), ir.imm);
+    commit(ir.dst);
+    break;
+  case MOV:
+    move(ir.dst, use(ir.a, 27));
+    break;
+  case ADD: case SUB: case SLT: case SLTU: {
+    string x = use(ir.a, 26), y = use(ir.b, 27);
+    string name = ir.op == ADD ? "add" : ir.op == SUB ? "sub" : ir.op == SLT ? "slt" : "sltu";
+    line(name + " " + def(ir.dst) + ", " + x + ", " + y);
+    commit(ir.dst);
+    break;
+  }
+  case MUL: case DIV: case MOD: {
+    string x = use(ir.a, 26), y = use(ir.b, 27);
+    line((ir.op == MUL ? "mult " : "div ") + x + ", " + y);
+    line((ir.op == MOD ? "mfhi " : "mflo ") + def(ir.dst));
+    commit(ir.dst);
+    break;
+  }
+  case LOAD: {
+    string x = use(ir.a, 26);
+    line("lw " + def(ir.dst) + ", 0(" + x + ")");
+    commit(ir.dst);
+    break;
+  }
+  case STORE: {
+    string x = use(ir.a, 26), y = use(ir.b, 27);
+    line("sw " + y + ", 0(" + x + ")");
+    break;
+  }
+  case LDSLOT:
+    line("lw " + def(ir.dst) + ", " + to_string(offset(ir.imm)) + "($29)");
+    commit(ir.dst);
+    break;
+  case STSLOT:
+    line("sw " + use(ir.a, 26) + ", " + to_string(offset(ir.imm)) + "($29)");
+    break;
+  case ADDR: {
+    string d = def(ir.dst);
+    loadConst(d, offset(ir.imm));
+    line("add " + d + ", $29, " + d);
+    commit(ir.dst);
+    break;
+  }
+  case PARAM:
+    if (proc.isWain) move(ir.dst, ir.imm == 0 ? "$1" : "$2");
+    else {
+      line("lw " + def(ir.dst) + ", " + to_string(offset(-(ir.imm + 1))) + (frameless ? "($30)" : "($29)"));
+      commit(ir.dst);
+    }
+    break;
+  case CALL: {
+    vector<int> saved = liveAcross(pos);
+    for (int r : saved) {
+      if (saveSlot[r] < 0) saveSlot[r] = proc.newSlot();
+      line("sw " + reg(r) + ", " + to_string(offset(saveSlot[r])) + "($29)");
+    }
+    for (size_t i = 0; i < ir.args.size(); ++i) {
+      line("sw " + use(ir.args[i], 26) + ", " + to_string(-4 * (int)(i + 1)) + "($30)");
+    }
+    callRuntime("F" + ir.callee);
+    for (int r : saved) line("lw " + reg(r) + ", " + to_string(offset(saveSlot[r])) + "($29)");
+    move(ir.dst, "$3");
+    break;
+  }
+  case PRINT:
+    line("add $1, " + use(ir.a, 26) + ", $0");
+    callRuntime("print");
+    break;
+  case NEW:
+    line("add $1, " + use(ir.a, 26) + ", $0");
+    callRuntime("new");
+    move(ir.dst, "$3");
+    break;
+  case DELETE:
+    line("add $1, " + use(ir.a, 26) + ", $0");
+    callRuntime("delete");
+    break;
+  case INIT:
+    line("add $1, " + use(ir.b, 27) + ", $0");
+    line("add $2, " + use(ir.a, 26) + ", $0");
+    callRuntime("init");
+    break;
+  case LABEL:
+    line(label(ir.imm) + ":");
+    break;
+  case JMP:
+    line("beq $0, $0, " + label(ir.imm));
+    break;
+  case BEQ: case BNE: {
+    string x = use(ir.a, 26), y = use(ir.b, 27);
+    line((ir.op == BEQ ? "beq " : "bne ") + x + ", " + y + ", " + label(ir.imm));
+    break;
+  }
+  case RET:
+    line("add $3, " + use(ir.a, 26) + ", $0");
+    if (!frameless) {
+      for (auto &cs : calleeSaves) line("lw " + reg(cs.first) + ", " + to_string(offset(cs.second)) + "($29)");
+      line("add $30, $29, $0");
+      if (!leaf) line("lw $31, " + to_string(-4 * (proc.nparams + 1)) + "($29)");
+      line("lw $29, " + to_string(-4 * (proc.nparams + 2)) + "($29)");
+    }
+    line("jr $31");
+    break;
+  case PHI:
+    throw runtime_error("phi left in " + proc.name);
+  }
+}
+
+void Emitter::emit() {
+  saveSlot.assign(32, -1);
+  leaf = true;
+  for (const Ir &ir : proc.code) {
+    if (ir.op == CALL || ir.op == PRINT || ir.op == NEW || ir.op == DELETE || ir.op == INIT) leaf = false;
+  }
+  // wain answers only to the loader, which expects nothing preserved.
+  vector<bool> used(32, false);
+  for (int r : proc.regOf) if (r > 0) used[r] = true;
+  for (int r = FIRST_CALLEE_SAVED; r <= 25 && !proc.isWain; ++r) {
+    if (used[r]) calleeSaves.push_back(make_pair(r, proc.newSlot()));
+  }
+  frameless = leaf && proc.nslots == 0;
+
+  vector<string> body;
+  swap(out, body);
+  for (size_t i = 0; i < proc.code.size(); ++i) instruction(i);
+  swap(out, body);
+  // The frame size is only known once spill and save slots are assigned.
+  line("F" + proc.name + ":");
+  if (!frameless) {
+    if (!leaf) line("sw $31, " + to_string(-4 * (proc.nparams + 1)) + "($30)");
+    line("sw $29, " + to_string(-4 * (proc.nparams + 2)) + "($30)");
+    line("add $29, $30, $0");
+    loadConst("$28", 4 * (proc.nparams + 2 + proc.nslots));
+    line("sub $30, $30, $28");
+    for (auto &cs : calleeSaves) line("sw " + reg(cs.first) + ", " + to_string(offset(cs.second)) + "($29)");
+  }
+  out.insert(out.end(), body.begin(), body.end());
+}
+
+// ---- Runtime ----
+
+// println: writes $1 in decimal and a newline. Preserves every register
+// but $3.
+const string PRINT_RUNTIME = R"(print:
+sw $1, -4($30)
+sw $2, -8($30)
+sw $4, -12($30)
+sw $5, -16($30)
+sw $6, -20($30)
+sw $7, -24($30)
+lis $4
+.word 24
+sub $30, $30, $4
+lis $5
+.word 0xffff000c
+lis $6
+.word 10
+lis $7
+.word 4
+add $2, $1, $0
+slt $3, $1, $0
+beq $3, $0, rtPrintDigits
+lis $3
+.word 45
+sw $3, 0($5)
+sub $2, $0, $1
+rtPrintDigits:
+lis $1
+.word 48
+add $3, $30, $0
+rtPrintNext:
+divu $2, $6
+mflo $2
+mfhi $4
+add $4, $4, $1
+sub $3, $3, $7
+sw $4, 0($3)
+bne $2, $0, rtPrintNext
+rtPrintOut:
+lw $4, 0($3)
+sw $4, 0($5)
+add $3, $3, $7
+bne $3, $30, rtPrintOut
+sw $6, 0($5)
+lis $4
+.word 24
+add $30, $30, $4
+lw $1, -4($30)
+lw $2, -8($30)
+lw $4, -12($30)
+lw $5, -16($30)
+lw $6, -20($30)
+lw $7, -24($30)
+jr $31
+)";
+
+// init/new/delete with -firstfit: a single first-fit free list, kept as
+// the baseline for the size-class allocator below. Blocks carry a one-word
+// header with their size in words (header included); a free block keeps
+// the next free block in its second word. The heap grows up toward the
+// stack from heapstart, or from the end of wain's array ($1, with $2
+// words) when that lies beyond it, as it does when a linked MERL file is
+// loaded footer and all. new returns NULL (1) when n < 1 or memory runs
+// out. All three preserve every register but $3.
+const string FIRSTFIT_RUNTIME = R"(init:
+sw $2, -4($30)
+sw $4, -8($30)
+sw $5, -12($30)
+add $2, $2, $2
+add $2, $2, $2
+add $2, $2, $1
+lis $4
+.word heapstart
+sltu $5, $4, $2
+beq $5, $0, rtInitHeap
+add $4, $2, $0
+rtInitHeap:
+lis $5
+.word rtHeapTop
+sw $4, 0($5)
+lis $5
+.word rtFreeList
+sw $0, 0($5)
+lw $2, -4($30)
+lw $4, -8($30)
+lw $5, -12($30)
+jr $31
+new:
+sw $1, -4($30)
+sw $2, -8($30)
+sw $4, -12($30)
+sw $5, -16($30)
+sw $6, -20($30)
+sw $7, -24($30)
+lis $3
+.word 1
+slt $2, $0, $1
+beq $2, $0, rtNewDone
+lis $7
+.word 4
+lis $2
+.word 1
+add $1, $1, $2
+lis $4
+.word rtFreeList
+rtNewScan:
+lw $5, 0($4)
+beq $5, $0, rtNewBump
+lw $6, 0($5)
+slt $2, $6, $1
+beq $2, $0, rtNewFound
+add $4, $5, $7
+beq $0, $0, rtNewScan
+rtNewFound:
+lw $6, 4($5)
+sw $6, 0($4)
+add $3, $5, $7
+beq $0, $0, rtNewDone
+rtNewBump:
+lis $4
+.word rtHeapTop
+lw $5, 0($4)
+add $6, $1, $1
+add $6, $6, $6
+add $6, $5, $6
+lis $2
+.word 4096
+sub $2, $30, $2
+sltu $2, $6, $2
+beq $2, $0, rtNewDone
+sw $6, 0($4)
+sw $1, 0($5)
+add $3, $5, $7
+rtNewDone:
+lw $1, -4($30)
+lw $2, -8($30)
+lw $4, -12($30)
+lw $5, -16($30)
+lw $6, -20($30)
+lw $7, -24($30)
+jr $31
+delete:
+sw $1, -4($30)
+sw $2, -8($30)
+sw $4, -12($30)
+lis $2
+.word 1
+beq $1, $2, rtDeleteDone
+lis $2
+.word 4
+sub $1, $1, $2
+lis $2
+.word rtFreeList
+lw $4, 0($2)
+sw $4, 4($1)
+sw $1, 0($2)
+rtDeleteDone:
+lw $1, -4($30)
+lw $2, -8($30)
+lw $4, -12($30)
+jr $31
+rtHeapTop:
+.word 0
+rtFreeList:
+.word 0
+heapstart:
+)";
+
+// init/new/delete: a segregated size-class allocator. Every block starts
+// with a header holding its size in bytes, header included.
+//
+// Small blocks (up to 32 words) and medium ones (up to 512 words, rounded
+// up to a multiple of 16) come from one LIFO list per size, headed in
+// rtClasses and linked through their first word, so new and delete stay
+// O(1) and touch three registers; they are never split or merged. Free
+// large blocks sit on doubly linked lists binned by powers of two, headed
+// in rtBins: word 1 is the next block and word 2 the address of the word
+// that points here, so unlinking needs no search. Since sizes are
+// multiples of 4 the low header bits of a large block carry flags: 1
+// while it is free and 2 while the block before it is a free large block,
+// which then also keeps its size in a footer. new takes the first fit in
+// its own bin, else the head of the next non-empty bin, where every block
+// fits, and splits off the rest when that is itself large; delete merges
+// a large block with free neighbours on both sides, and gives it back to
+// the bump region when it ends at the top of the heap. Anything else is
+// bump allocated from rtHeapTop toward the stack. new returns NULL (1)
+// when n < 1 or memory runs out. All three preserve every register but $3.
+const string SIZECLASS_RUNTIME = R"(init:
+sw $2, -4($30)
+sw $4, -8($30)
+sw $5, -12($30)
+add $2, $2, $2
+add $2, $2, $2
+add $2, $2, $1
+lis $4
+.word heapstart
+sltu $5, $4, $2
+beq $5, $0, rtInitHeap
+add $4, $2, $0
+rtInitHeap:
+lis $2
+.word rtHeapTop
+sw $4, 0($2)
+lw $2, -4($30)
+lw $4, -8($30)
+lw $5, -12($30)
+jr $31
+new:
+sw $2, -4($30)
+sw $4, -8($30)
+sw $6, -12($30)
+lis $3
+.word 1
+sub $6, $1, $3
+lis $4
+.word 32
+sltu $2, $6, $4
+beq $2, $0, rtNewMedium
+add $6, $1, $1
+add $6, $6, $6
+lis $4
+.word rtClasses
+add $4, $4, $6
+lw $3, 4($4)
+beq $3, $0, rtNewSlow
+lw $2, 0($3)
+sw $2, 4($4)
+beq $0, $0, rtNewDone
+rtNewMedium:
+lis $4
+.word 512
+sltu $2, $6, $4
+beq $2, $0, rtNewSlow
+lis $4
+.word 15
+add $6, $1, $4
+lis $4
+.word 16
+divu $6, $4
+mflo $6
+add $6, $6, $6
+add $6, $6, $6
+lis $4
+.word rtClasses
+add $4, $4, $6
+lw $3, 128($4)
+beq $3, $0, rtNewSlow
+lw $2, 0($3)
+sw $2, 128($4)
+beq $0, $0, rtNewDone
+rtNewSlow:
+sw $1, -16($30)
+sw $5, -20($30)
+sw $7, -24($30)
+sw $8, -28($30)
+sw $9, -32($30)
+lis $3
+.word 1
+slt $2, $0, $1
+beq $2, $0, rtNewSlowDone
+lis $4
+.word 0x01000000
+slt $2, $1, $4
+beq $2, $0, rtNewSlowDone
+lis $7
+.word 4
+add $6, $1, $1
+add $6, $6, $6
+add $6, $6, $7
+lis $4
+.word 136
+sltu $2, $6, $4
+bne $2, $0, rtNewBump
+lis $4
+.word 2056
+sltu $2, $6, $4
+beq $2, $0, rtNewLarge
+lis $4
+.word 15
+add $6, $1, $4
+lis $4
+.word 16
+divu $6, $4
+mflo $6
+lis $4
+.word 64
+multu $6, $4
+mflo $6
+add $6, $6, $7
+rtNewBump:
+lis $4
+.word rtHeapTop
+lw $8, 0($4)
+add $9, $8, $6
+lis $2
+.word 4096
+sub $2, $30, $2
+sltu $2, $9, $2
+beq $2, $0, rtNewSlowDone
+sw $9, 0($4)
+sw $6, 0($8)
+add $3, $8, $7
+beq $0, $0, rtNewSlowDone
+rtNewLarge:
+lis $4
+.word rtBins
+lis $2
+.word 4096
+rtNewBin:
+sltu $1, $6, $2
+bne $1, $0, rtNewBinFound
+add $2, $2, $2
+add $4, $4, $7
+beq $0, $0, rtNewBin
+rtNewBinFound:
+lis $5
+.word 1
+lw $8, 0($4)
+rtNewScan:
+beq $8, $0, rtNewNext
+lw $9, 0($8)
+sub $9, $9, $5
+sltu $2, $9, $6
+beq $2, $0, rtNewFit
+lw $8, 4($8)
+beq $0, $0, rtNewScan
+rtNewNext:
+lis $2
+.word rtClasses
+rtNewNextBin:
+add $4, $4, $7
+beq $4, $2, rtNewBump
+lw $8, 0($4)
+beq $8, $0, rtNewNextBin
+lw $9, 0($8)
+sub $9, $9, $5
+rtNewFit:
+lw $1, 4($8)
+lw $2, 8($8)
+sw $1, 0($2)
+beq $1, $0, rtNewSplit
+sw $2, 8($1)
+rtNewSplit:
+sub $5, $9, $6
+lis $2
+.word 2056
+sltu $2, $5, $2
+bne $2, $0, rtNewWhole
+sw $6, 0($8)
+add $1, $8, $6
+lis $2
+.word 1
+add $2, $5, $2
+sw $2, 0($1)
+add $2, $1, $5
+sw $5, -4($2)
+lis $4
+.word rtBins
+lis $2
+.word 4096
+rtNewRemBin:
+sltu $9, $5, $2
+bne $9, $0, rtNewRemBinFound
+add $2, $2, $2
+add $4, $4, $7
+beq $0, $0, rtNewRemBin
+rtNewRemBinFound:
+lw $2, 0($4)
+sw $2, 4($1)
+sw $4, 8($1)
+beq $2, $0, rtNewPushed
+add $9, $1, $7
+sw $9, 8($2)
+rtNewPushed:
+sw $1, 0($4)
+add $3, $8, $7
+beq $0, $0, rtNewSlowDone
+rtNewWhole:
+sw $9, 0($8)
+add $3, $8, $7
+add $5, $8, $9
+lw $2, 0($5)
+lis $1
+.word 2056
+sltu $1, $2, $1
+bne $1, $0, rtNewSlowDone
+lis $1
+.word 2
+sub $2, $2, $1
+sw $2, 0($5)
+rtNewSlowDone:
+lw $1, -16($30)
+lw $5, -20($30)
+lw $7, -24($30)
+lw $8, -28($30)
+lw $9, -32($30)
+rtNewDone:
+lw $2, -4($30)
+lw $4, -8($30)
+lw $6, -12($30)
+jr $31
+delete:
+sw $2, -4($30)
+sw $4, -8($30)
+lis $2
+.word 1
+beq $1, $2, rtDeleteDone
+lw $4, -4($1)
+lis $2
+.word 136
+sltu $2, $4, $2
+beq $2, $0, rtDeleteMedium
+lis $2
+.word rtClasses
+add $4, $4, $2
+lw $2, 0($4)
+sw $2, 0($1)
+sw $1, 0($4)
+beq $0, $0, rtDeleteDone
+rtDeleteMedium:
+lis $2
+.word 2056
+sltu $2, $4, $2
+beq $2, $0, rtDeleteLarge
+lis $2
+.word 64
+divu $4, $2
+mflo $4
+add $4, $4, $4
+add $4, $4, $4
+lis $2
+.word rtClasses
+add $4, $4, $2
+lw $2, 128($4)
+sw $2, 0($1)
+sw $1, 128($4)
+beq $0, $0, rtDeleteDone
+rtDeleteLarge:
+sw $1, -12($30)
+sw $5, -16($30)
+sw $6, -20($30)
+sw $7, -24($30)
+sw $8, -28($30)
+sw $9, -32($30)
+lis $7
+.word 4
+sub $8, $1, $7
+lw $9, 0($8)
+divu $9, $7
+mfhi $5
+sub $9, $9, $5
+add $3, $0, $0
+add $6, $8, $9
+lis $2
+.word rtHeapTop
+lw $2, 0($2)
+beq $6, $2, rtDeletePrev
+lw $1, 0($6)
+divu $1, $7
+mfhi $2
+beq $2, $0, rtDeletePrev
+sub $1, $1, $2
+add $9, $9, $1
+add $3, $2, $0
+lw $1, 4($6)
+lw $2, 8($6)
+sw $1, 0($2)
+beq $1, $0, rtDeletePrev
+sw $2, 8($1)
+rtDeletePrev:
+lis $2
+.word 2
+slt $2, $5, $2
+bne $2, $0, rtDeleteFree
+lw $2, -4($8)
+sub $8, $8, $2
+add $9, $9, $2
+lw $1, 4($8)
+lw $2, 8($8)
+sw $1, 0($2)
+beq $1, $0, rtDeleteFree
+sw $2, 8($1)
+rtDeleteFree:
+add $6, $8, $9
+lis $1
+.word rtHeapTop
+lw $2, 0($1)
+bne $6, $2, rtDeleteList
+sw $8, 0($1)
+beq $0, $0, rtDeleteLargeDone
+rtDeleteList:
+lis $2
+.word 1
+add $2, $9, $2
+sw $2, 0($8)
+sw $9, -4($6)
+bne $3, $0, rtDeleteTagged
+lw $2, 0($6)
+lis $1
+.word 2056
+sltu $1, $2, $1
+bne $1, $0, rtDeleteTagged
+lis $1
+.word 2
+add $2, $2, $1
+sw $2, 0($6)
+rtDeleteTagged:
+lis $4
+.word rtBins
+lis $2
+.word 4096
+rtDeleteBin:
+sltu $1, $9, $2
+bne $1, $0, rtDeleteBinFound
+add $2, $2, $2
+add $4, $4, $7
+beq $0, $0, rtDeleteBin
+rtDeleteBinFound:
+lw $2, 0($4)
+sw $2, 4($8)
+sw $4, 8($8)
+beq $2, $0, rtDeletePushed
+add $1, $8, $7
+sw $1, 8($2)
+rtDeletePushed:
+sw $8, 0($4)
+rtDeleteLargeDone:
+lw $1, -12($30)
+lw $5, -16($30)
+lw $6, -20($30)
+lw $7, -24($30)
+lw $8, -28($30)
+lw $9, -32($30)
+rtDeleteDone:
+lw $2, -4($30)
+lw $4, -8($30)
+jr $31
+rtHeapTop:
+.word 0
+rtBins:
+.word 0
+.word 0
+.word 0
+.word 0
+.word 0
+.word 0
+.word 0
+.word 0
+.word 0
+.word 0
+.word 0
+.word 0
+.word 0
+.word 0
+.word 0
+.word 0
+rtClasses:
+.word 0
+.word 0
+.word 0
+.word 0
+.word 0
+.word 0
+.word 0
+.word 0
+.word 0
+.word 0
+.word 0
+.word 0
+.word 0
+.word 0
+.word 0
+.word 0
+.word 0
+.word 0
+.word 0
+.word 0
+.word 0
+.word 0
+.word 0
+.word 0
+.word 0
+.word 0
+.word 0
+.word 0
+.word 0
+.word 0
+.word 0
+.word 0
+.word 0
+.word 0
+.word 0
+.word 0
+.word 0
+.word 0
+.word 0
+.word 0
+.word 0
+.word 0
+.word 0
+.word 0
+.word 0
+.word 0
+.word 0
+.word 0
+.word 0
+.word 0
+.word 0
+.word 0
+.word 0
+.word 0
+.word 0
+.word 0
+.word 0
+.word 0
+.word 0
+.word 0
+.word 0
+.word 0
+.word 0
+.word 0
+.word 0
+heapstart:
+)";
+
+// ---- Compile cache ----
+
+// Part of every cache key, so entries written for other code generation
+// are never reused. Bump it whenever the generated code or the entry
+// format changes.
+const string CACHE_VERSION = "wlp4gen 4";
+
+uint64_t fnv1a(uint64_t h, const string &s) {
+  for (unsigned char c : s) h = (h ^ c) * 1099511628211ull;
+  return h;
+}
+
+// Hash of the cache version, the code generation options and the
+// procedure's token stream (its leaves, in order).
+uint64_t procedureKey(Tree *proc, const string &options) {
+  uint64_t h = fnv1a(fnv1a(14695981039346656037ull, CACHE_VERSION), "\n" + options + "\n");
+  vector<Tree*> stack = {proc};
+  while (!stack.empty()) {
+    Tree *t = stack.back();
+    stack.pop_back();
+    if (t->leaf) h = fnv1a(h, t->kind + " " + t->lexeme + "\n");
+    for (auto c = t->children.rbegin(); c != t->children.rend(); ++c) stack.push_back(*c);
+  }
+  return h;
+}
+
+// What the driver needs from a procedure besides its code.
+class CacheEntry {
+  public:
+  bool usesHeap = false;
+  bool usesPrint = false;
+  int statements = 0;
+  int tailCalls = 0;        // the rest is only reported by -stats
+  bool frameless = false;
+  bool leaf = false;
+  vector<string> lines;
+};
+
+// Generated assembly per procedure, one file per key in a directory that
+// wlp4parser -cache may share. A hit refreshes the file's modification
+// time; once the directory holds more than limit bytes, the least recently
+// used entries of either tool are removed. The Cache in wlp4parser.cc is a
+// near copy of this one sharing the directory and eviction rules: change
+// the two together.
+class Cache {
+    string dir;
+    uintmax_t limit;
+
+    string path(uint64_t key) const {
+      char name[24];
+      snprintf(name, sizeof name, "%016llx.s", (unsigned long long)key);
+      return dir + "/" + name;
+    }
+
+    public:
+    int hits = 0, misses = 0, evicted = 0;
+
+    Cache(const string &d, uintmax_t l) : dir(d), limit(l) {
+      filesystem::create_directories(dir);
+    }
+    bool load(uint64_t key, CacheEntry &e);
+    void store(uint64_t key, const CacheEntry &e);
+    void evict();
+    void report(ostream &out);
+};
+
+bool Cache::load(uint64_t key, CacheEntry &e) {
+  string p = path(key);
+  ifstream in(p);
+  string line;
+  if (in && getline(in, line)) {
+    istringstream header(line);
+    string magic;
+    header >> magic >> e.usesHeap >> e.usesPrint >> e.statements >> e.tailCalls >> e.frameless >> e.leaf;
+    if (header && magic == "wlp4gen-cache") {
+      e.lines.clear();
+      while (getline(in, line)) e.lines.push_back(line);
+      error_code ec;
+      filesystem::last_write_time(p, filesystem::file_time_type::clock::now(), ec);
+      ++hits;
+      return true;
+    }
+  }
+  ++misses;
+  return false;
+}
+
+void Cache::store(uint64_t key, const CacheEntry &e) {
+  // Written aside and renamed, so a reader never sees half an entry.
+  string p = path(key), tmp = p + ".tmp";
+  {
+    ofstream out(tmp);
+    out << "wlp4gen-cache " << e.usesHeap << " " << e.usesPrint << " " << e.statements << " "
+        << e.tailCalls << " " << e.frameless << " " << e.leaf << "\n";
+    for (const string &l : e.lines) out << l << "\n";
+    if (!out) throw runtime_error("cannot write cache entry " + tmp);
+  }
+  filesystem::rename(tmp, p);
+}
+
+void Cache::evict() {
+  vector<pair<filesystem::file_time_type, filesystem::path>> entries;
+  uintmax_t total = 0;
+  for (auto &f : filesystem::directory_iterator(dir)) {
+    string ext = f.path().extension();
+    if (!f.is_regular_file() || (ext != ".s" && ext != ".tree")) continue;
+    total += f.file_size();
+    entries.push_back(make_pair(f.last_write_time(), f.path()));
+  }
+  if (total <= limit) return;
+  sort(entries.begin(), entries.end());
+  for (auto &e : entries) {
+    if (total <= limit) break;
+    total -= filesystem::file_size(e.second);
+    filesystem::remove(e.second);
+    ++evicted;
+  }
+}
+
+void Cache::report(ostream &out) {
+  out << "cache: " << hits << " hits, " << misses << " misses, " << evicted << " evicted" << endl;
+}
+
+// ---- Driver ----
+
+vector<Tree*> procedureList(Tree *root) {
+  vector<Tree*> procs;
+  Tree *t = root->child(1);
+  while (t->rule == "procedures procedure procedures") {
+    procs.push_back(t->child(0));
+    t = t->child(1);
+  }
+  procs.push_back(t->child(0));
+  return procs;
+}
+
+int countMemoryOps(const vector<string> &lines) {
+  int n = 0;
+  for (const string &l : lines) if (l.compare(0, 3, "lw ") == 0 || l.compare(0, 3, "sw ") == 0) ++n;
+  return n;
+}
+
+int main(int argc, char *argv[]) {
+  Tree *root = nullptr;
+  try {
+    bool naive = false;
+    bool stats = false;
+    bool optimize = false;
+    bool firstFit = false;
+    bool merl = false;
+    bool runtimeOnly = false;
+    string cacheDir;
+    uintmax_t cacheMB = 64;
+    for (int i = 1; i < argc; ++i) {
+      string a = argv[i];
+      bool hasArg = i + 1 < argc;
+      if (a == "-naive") naive = true;
+      else if (a == "-stats") stats = true;
+      else if (a == "-O") optimize = true;
+      else if (a == "-firstfit") firstFit = true;
+      else if (a == "-merl") merl = true;
+      else if (a == "-runtime") runtimeOnly = true;
+      else if (a == "-cache" && hasArg) cacheDir = argv[++i];
+      else if (a == "-cache-size" && hasArg) cacheMB = stoul(argv[++i]);
+      else throw runtime_error("usage: wlp4gen [-O] [-naive] [-firstfit] [-stats] [-cache dir [-cache-size MB]] [-merl] < tree\n"
+                               "       wlp4gen -runtime [-firstfit]");
+    }
+    if (runtimeOnly) {
+      // The runtime as a MERL object of its own; link it last, since the
+      // heap starts where it ends.
+      cout << ".export print\n.export init\n.export new\n.export delete\n";
+      cout << PRINT_RUNTIME << (firstFit ? FIRSTFIT_RUNTIME : SIZECLASS_RUNTIME);
+      return 0;
+    }
+    root = readTree(cin);
+    vector<Tree*> trees = procedureList(root);
+    // wain comes last in the source but must be first in memory.
+    rotate(trees.begin(), trees.end() - 1, trees.end());
+
+    unique_ptr<Cache> cache;
+    if (!cacheDir.empty()) cache.reset(new Cache(cacheDir, cacheMB << 20));
+    string options = string(optimize ? "-O " : "") + (naive ? "-naive" : "");
+    size_t n = trees.size();
+    vector<Proc> procs(n);
+    vector<CacheEntry> entries(n);
+    vector<uint64_t> keys(n);
+    vector<bool> cached(n, false);
+    bool usesHeap = false, usesPrint = false;
+    // wain goes last: whether it sets up the heap depends on the others.
+    for (size_t k = 1; k <= n; ++k) {
+      size_t i = k % n;
+      CacheEntry &e = entries[i];
+      if (cache) {
+        keys[i] = procedureKey(trees[i], options + (i == 0 && usesHeap ? " heap" : ""));
+        cached[i] = cache->load(keys[i], e);
+      }
+      if (!cached[i]) {
+        Lowering(procs[i], e.usesHeap, e.usesPrint).procedure(trees[i]);
+        e.statements = procs[i].statements;
+      }
+      usesHeap = usesHeap || e.usesHeap;
+      usesPrint = usesPrint || e.usesPrint;
+    }
+    vector<int> pool = naive ? vector<int>() : allocatable();
+    Optimizer opt;
+    int statements = 0, memOps = 0;
+    for (size_t i = 0; i < n; ++i) {
+      Proc &p = procs[i];
+      CacheEntry &e = entries[i];
+      if (!cached[i]) {
+        if (!usesHeap) {
+          p.code.erase(remove_if(p.code.begin(), p.code.end(), [](const Ir &ir) { return ir.op == INIT; }),
+                       p.code.end());
+        }
+        e.tailCalls = eliminateTailCalls(p);
+        if (optimize) opt.run(p);
+        allocateRegisters(p, pool);
+        Emitter(p, e.lines).emit();
+        e.frameless = p.frameless;
+        e.leaf = p.leaf;
+        if (cache) cache->store(keys[i], e);
+      }
+      if (stats) {
+        int m = countMemoryOps(e.lines);
+        cerr << trees[i]->child(1)->lexeme << ": " << e.statements << " statements, " << e.lines.size()
+             << " lines, " << m << " lw/sw";
+        if (cached[i]) cerr << ", cached";
+        if (e.tailCalls) cerr << ", " << e.tailCalls << " tail calls";
+        if (e.frameless) cerr << ", no frame";
+        else if (e.leaf) cerr << ", leaf";
+        cerr << endl;
+        statements += e.statements;
+        memOps += m;
+      }
+    }
+    if (cache) cache->evict();
+    if (stats && optimize) opt.report(cerr);
+    if (stats && cache) cache->report(cerr);
+    if (stats) {
+      cerr << "total: " << statements << " statements, " << memOps << " lw/sw ("
+           << (statements ? (double)memOps / statements : 0) << " per statement)" << endl;
+    }
+    if (merl) {
+      if (usesPrint) cout << ".import print\n";
+      if (usesHeap) cout << ".import init\n.import new\n.import delete\n";
+    }
+    for (const CacheEntry &e : entries) {
+      for (const string &l : e.lines) cout << l << "\n";
+    }
+    if (!merl) {
+      if (usesPrint) cout << PRINT_RUNTIME;
+      if (usesHeap) cout << (firstFit ? FIRSTFIT_RUNTIME : SIZECLASS_RUNTIME);
+    }
+  } catch(runtime_error &e) {
+    cerr << "ERROR: " << e.what() << "\n";
+    delete root;
+    return 1;
+  }
+  delete root;
+  return 0;
+}
@@ -4,6 +4,13 @@
 #include <utility>
 #include <sstream>
 #include <cstring>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <algorithm>
+#include <filesystem>
+#include <memory>
+#include <unordered_map>
 #include "wlp4data.h"
 //#include "wlp4data.cc"
 using namespace std;
@@ -36,10 +43,10 @@ class Tree {
   }
   void print(ostream &out = cout) {
     if (data.second == "") data.second = ".EMPTY";
-    cout << data.first << " " << data.second << endl;
+    out << data.first << " " << data.second << "\n";
     int size = children.size();
     for(int i = 0; i < size; ++i){
-      children[i]->print();
+      children[i]->print(out);
     }
   }
   ~Tree() {
@@ -56,6 +63,8 @@ vector<int> states;
 vector<Tree*> treestack;
 
 vector<pair<string, string>> Input;
+vector<string> Positions;  // "line:column" of each token, if the scanner gave one
+vector<string> errors;
 int INDEX = 0;
 
 const string CFG = ".CFG";
@@ -63,26 +72,34 @@ const string TR = ".TRANSITIONS";
 const string RD = ".REDUCTIONS";
 
 class DFA{
-    public:
-    vector<pair<pair<int, string>, int>> transitions;
-    vector<pair<pair<int, int>, string>> reductions;
+    // Indexed by state: symbol -> next state, lookahead -> rule number.
+    vector<unordered_map<string, int>> transitions;
+    vector<unordered_map<string, int>> reductions;
 
-    int getTransition(int state, string LHS){
-      for (auto n : transitions){
-        if ((state == n.first.first) && (LHS == n.first.second)){
-          return n.second;
-        }
-      }
-      return INT_MIN;
+    static int find(const vector<unordered_map<string, int>> &table, int state, const string &symbol) {
+      if (state < 0 || state >= (int)table.size()) return INT_MIN;
+      auto it = table[state].find(symbol);
+      return it == table[state].end() ? INT_MIN : it->second;
     }
 
-    int getReduction(int state, string symbol){
-      for (auto n: reductions){
-        if((state == n.first.first) && (symbol == n.second)){
-          return n.first.second;
-        }
-      }
-      return INT_MIN;
+    public:
+    // The first entry listed for a state and symbol wins.
+    void addTransition(int state, const string &symbol, int next) {
+      if (state >= (int)transitions.size()) transitions.resize(state + 1);
+      transitions[state].emplace(symbol, next);
+    }
+    void addReduction(int state, const string &symbol, int rule) {
+      if (state >= (int)reductions.size()) reductions.resize(state + 1);
+      reductions[state].emplace(symbol, rule);
+    }
+    int getTransition(int state, const string &LHS){
+      return find(transitions, state, LHS);
+    }
+    int getReduction(int state, const string &symbol){
+      return find(reductions, state, symbol);
+    }
+    bool hasAction(int state, const string &symbol) {
+      return getReduction(state, symbol) != INT_MIN || getTransition(state, symbol) != INT_MIN;
     }
 };
 
@@ -130,7 +147,7 @@ void getDATA(istream &in){
     int state1;
     stringstream line(s);
     line >> state0 >> symbol >> state1;
-    dfa.transitions.push_back(make_pair(make_pair(state0, symbol),state1));
+    dfa.addTransition(state0, symbol, state1);
     
   }
   //Reductions
@@ -143,7 +160,7 @@ void getDATA(istream &in){
     string rulenum;
     stringstream line1(s);
     line1 >> state0 >> symbol >> rulenum;
-    dfa.reductions.push_back(make_pair(make_pair(state0, symbol),rulenum));
+    dfa.addReduction(state0, rulenum, symbol);
   }
 }
 
@@ -152,14 +169,18 @@ void getINPUT(){
   string kind;
   string lexeme;
   Input.push_back(make_pair("BOF", "BOF"));
+  Positions.push_back("");
   while(true){
     if (!(getline(cin, s))){
       Input.push_back(make_pair("EOF","EOF"));
+      Positions.push_back("");
       break;
     }
     istringstream ss{s};
-    ss >> kind >> lexeme;
+    string where;
+    ss >> kind >> lexeme >> where;
     Input.push_back(make_pair(kind, lexeme));
+    Positions.push_back(where);
   }
 }
 
@@ -201,44 +222,286 @@ void reducetrees(Rule r){
   treestack.push_back(T);
 }
 
-void shift(pair<string, string> r){
-  string s1 = r.first;
-  string s2 = r.second;
-  Tree *T = new Tree(s1, s2);
-  treestack.push_back(T);
-  int newstate = dfa.getTransition(states[states.size() - 1], s1);
-  if (newstate != INT_MIN) states.push_back(newstate);
-  else throw runtime_error("No transition");
+void shift(const pair<string, string> &r, int newstate){
+  treestack.push_back(new Tree(r.first, r.second));
+  states.push_back(newstate);
+}
+
+// "line 3, column 7: unexpected SEMI ;" for the token at Input[i].
+string syntaxError(int i) {
+  if (Input[i].first == "EOF") return "unexpected end of input";
+  string where = "token " + to_string(i);
+  size_t colon = Positions[i].find(':');
+  if (colon != string::npos) {
+    where = "line " + Positions[i].substr(0, colon) + ", column " + Positions[i].substr(colon + 1);
+  }
+  return where + ": unexpected " + Input[i].first + " " + Input[i].second;
 }
 
+// Panic mode: skips to the next SEMI or RBRACE and pops the parse stack
+// until its top state has an action for the token after it, or for the
+// RBRACE itself, which may close an enclosing block. Blocks opened in the
+// skipped tokens are skipped whole. Tokens up to after are never resumed at
+// again. Returns the index to resume at, or -1.
+int recover(int i, int after) {
+  int depth = 0;
+  for (int j = i; Input[j].first != "EOF"; ++j) {
+    const string &kind = Input[j].first;
+    int first = j + 1;
+    if (kind == "LBRACE") {
+      ++depth;
+      continue;
+    } else if (kind == "RBRACE" && depth > 0) {
+      if (--depth > 0) continue;
+    } else if (kind == "RBRACE") {
+      first = j;
+    } else if (kind != "SEMI" || depth > 0) {
+      continue;
+    }
+    for (int r = first; r <= j + 1; ++r) {
+      if (r <= after) continue;
+      for (int d = states.size() - 1; d >= 0; --d) {
+        if (!dfa.hasAction(states[d], Input[r].first)) continue;
+        while ((int)states.size() > d + 1) {
+          states.pop_back();
+          delete treestack.back();
+          treestack.pop_back();
+        }
+        return r;
+      }
+    }
+  }
+  return -1;
+}
+
+// Parses Input, collecting syntax errors in errors. After an error the
+// parse resumes as recover() says; errors found before three more tokens
+// have been shifted are taken to follow from the first and not reported.
 void beginparse(){
-  for (auto i : Input){
-    int current_state = states[states.size() -1];
-    string s1 = i.first;
-    string s2 = i.second;
-    int newrule = dfa.getReduction(current_state, s1);
-    while(newrule != INT_MIN){
+  int shifted = 3;
+  int resumed = -1;
+  for (int i = 0; ; ){
+    const pair<string, string> &token = Input[i];
+    int newrule;
+    while((newrule = dfa.getReduction(states.back(), token.first)) != INT_MIN){
       reducetrees(cfg[newrule]);
       reducestates(cfg[newrule]);
-      current_state = states[states.size() -1];
-      newrule = dfa.getReduction(current_state, s1);
     }
-    shift(i);
-    if(i.first == "EOF") {
+    int newstate = dfa.getTransition(states.back(), token.first);
+    if (newstate == INT_MIN) {
+      if (shifted >= 3) errors.push_back(syntaxError(i));
+      resumed = i = recover(i, resumed);
+      if (i < 0) return;
+      shifted = 0;
+      continue;
+    }
+    shift(token, newstate);
+    ++shifted;
+    if(token.first == "EOF") {
       reducetrees(cfg[0]);
       break;
     }
+    ++i;
   }
 }
 
-int main(){
+// Procedure cache: with -cache DIR, each procedure's subtree is stored
+// under a hash of its tokens and CACHE_VERSION. Procedures found there
+// are parsed as a placeholder with the same name, which costs a handful of
+// tokens, and their stored subtree is printed in its place. Bump
+// CACHE_VERSION whenever the grammar or the tree output changes. The
+// lookup, store and eviction code is a near copy of the Cache in
+// wlp4gen.cc, which shares the directory: change the two together.
+const string CACHE_VERSION = "wlp4parser 1";
+
+uint64_t fnv1a(uint64_t h, const string &s) {
+  for (unsigned char c : s) h = (h ^ c) * 1099511628211ull;
+  return h;
+}
+
+class Cache {
+    string dir;
+    uintmax_t limit;
+
+    string path(uint64_t key) const {
+      char name[24];
+      snprintf(name, sizeof name, "%016llx.tree", (unsigned long long)key);
+      return dir + "/" + name;
+    }
+
+    public:
+    int hits = 0, misses = 0, evicted = 0;
+
+    Cache(const string &d, uintmax_t l) : dir(d), limit(l) {
+      filesystem::create_directories(dir);
+    }
+    bool load(uint64_t key, string &text) {
+      ifstream in(path(key));
+      if (!in) {
+        ++misses;
+        return false;
+      }
+      stringstream ss;
+      ss << in.rdbuf();
+      text = ss.str();
+      error_code ec;
+      filesystem::last_write_time(path(key), filesystem::file_time_type::clock::now(), ec);
+      ++hits;
+      return true;
+    }
+    void store(uint64_t key, const string &text) {
+      string p = path(key), tmp = p + ".tmp";
+      {
+        ofstream out(tmp);
+        out << text;
+        if (!out) throw runtime_error("cannot write cache entry " + tmp);
+      }
+      filesystem::rename(tmp, p);
+    }
+    // Drops least recently used entries, of any tool sharing the
+    // directory, until it fits in limit bytes.
+    void evict() {
+      vector<pair<filesystem::file_time_type, filesystem::path>> entries;
+      uintmax_t total = 0;
+      for (auto &f : filesystem::directory_iterator(dir)) {
+        string ext = f.path().extension();
+        if (!f.is_regular_file() || (ext != ".s" && ext != ".tree")) continue;
+        total += f.file_size();
+        entries.push_back(make_pair(f.last_write_time(), f.path()));
+      }
+      if (total <= limit) return;
+      sort(entries.begin(), entries.end());
+      for (auto &e : entries) {
+        if (total <= limit) break;
+        total -= filesystem::file_size(e.second);
+        filesystem::remove(e.second);
+        ++evicted;
+      }
+    }
+};
+
+class Procedure {
+  public:
+  int first, last;   // token range in Input
+  uint64_t key;
+  bool cached;
+  string text;       // subtree, once known
+};
+
+// Splits Input at the closing brace of each top-level procedure. Empty if
+// the tokens do not look like a list of procedures; the program is then
+// parsed as is and errors are reported as usual.
+vector<Procedure> splitProcedures() {
+  vector<Procedure> procs;
+  int depth = 0, first = 1, last = Input.size() - 1;
+  for (int i = 1; i < last; ++i) {
+    if (Input[i].first == "LBRACE") ++depth;
+    if (Input[i].first != "RBRACE") continue;
+    if (--depth < 0) return {};
+    if (depth > 0) continue;
+    if (i - first < 2 || Input[first].first != "INT") return {};
+    Procedure p;
+    p.first = first;
+    p.last = i + 1;
+    p.cached = false;
+    uint64_t h = fnv1a(14695981039346656037ull, CACHE_VERSION + "\n");
+    for (int j = first; j < i + 1; ++j) h = fnv1a(h, Input[j].first + " " + Input[j].second + "\n");
+    p.key = h;
+    procs.push_back(p);
+    first = i + 1;
+  }
+  if (procs.empty() || first != last) return {};
+  return procs;
+}
+
+// Replaces cached procedures in Input by the shortest procedure (or wain)
+// with the same name.
+void substitutePlaceholders(const vector<Procedure> &procs) {
+  vector<pair<string, string>> input;
+  vector<string> positions;
+  input.push_back(Input[0]);
+  for (const Procedure &p : procs) {
+    if (!p.cached) {
+      positions.resize(input.size());
+      positions.insert(positions.end(), Positions.begin() + p.first, Positions.begin() + p.last);
+      input.insert(input.end(), Input.begin() + p.first, Input.begin() + p.last);
+    } else if (Input[p.first + 1].first == "WAIN") {
+      input.insert(input.end(), {{"INT", "int"}, {"WAIN", "wain"}, {"LPAREN", "("}, {"INT", "int"},
+                                 {"ID", "a"}, {"COMMA", ","}, {"INT", "int"}, {"ID", "b"},
+                                 {"RPAREN", ")"}, {"LBRACE", "{"}, {"RETURN", "return"},
+                                 {"NUM", "0"}, {"SEMI", ";"}, {"RBRACE", "}"}});
+    } else {
+      input.insert(input.end(), {{"INT", "int"}, Input[p.first + 1], {"LPAREN", "("}, {"RPAREN", ")"},
+                                 {"LBRACE", "{"}, {"RETURN", "return"}, {"NUM", "0"}, {"SEMI", ";"},
+                                 {"RBRACE", "}"}});
+    }
+  }
+  input.push_back(Input.back());
+  positions.resize(input.size());
+  Input = input;
+  Positions = positions;
+}
+
+// Prints the tree with each procedure's subtree taken from procs where
+// cached, storing the others.
+void printProgram(Tree *root, vector<Procedure> &procs, Cache &cache) {
+  cout << root->data.first << " " << root->data.second << "\n";
+  root->children[0]->print(cout);
+  Tree *t = root->children[1];
+  for (Procedure &p : procs) {
+    cout << t->data.first << " " << t->data.second << "\n";
+    if (!p.cached) {
+      ostringstream text;
+      t->children[0]->print(text);
+      p.text = text.str();
+      cache.store(p.key, p.text);
+    }
+    cout << p.text;
+    if (t->children.size() > 1) t = t->children[1];
+  }
+  root->children[2]->print(cout);
+}
+
+int main(int argc, char *argv[]){
     try{
+        string cacheDir;
+        uintmax_t cacheMB = 64;
+        bool stats = false;
+        for (int i = 1; i < argc; ++i) {
+          string a = argv[i];
+          if (a == "-cache" && i + 1 < argc) cacheDir = argv[++i];
+          else if (a == "-cache-size" && i + 1 < argc) cacheMB = stoul(argv[++i]);
+          else if (a == "-stats") stats = true;
+          else throw runtime_error("usage: wlp4parser [-stats] [-cache dir [-cache-size MB]] < tokens");
+        }
         states.push_back(0);
         stringstream s(WLP4_COMBINED);
         getDATA(s);
         getINPUT();
+        vector<Procedure> procs;
+        unique_ptr<Cache> cache;
+        if (!cacheDir.empty()) {
+          cache.reset(new Cache(cacheDir, cacheMB << 20));
+          procs = splitProcedures();
+          for (Procedure &p : procs) p.cached = cache->load(p.key, p.text);
+          substitutePlaceholders(procs);
+        }
         beginparse();
-        treestack[0]->print();
+        if (!errors.empty()) {
+          for (const string &e : errors) cerr << "ERROR: " << e << "\n";
+          for (Tree *t : treestack) delete t;
+          return 1;
+        }
+        if (procs.empty()) {
+          treestack[0]->print();
+        } else {
+          printProgram(treestack[0], procs, *cache);
+          cache->evict();
+        }
+        if (stats && cache) {
+          cerr << "cache: " << cache->hits << " hits, " << cache->misses << " misses, "
+               << cache->evicted << " evicted" << endl;
+        }
         int size = treestack.size();
         for(int i = 0; i < size; ++i){
           delete treestack[i];
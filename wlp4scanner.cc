@@ -4,6 +4,10 @@
 #include <utility>
 #include <sstream>
 #include <cstring>
+#include <array>
+#include <map>
+#include <unordered_map>
+#include <chrono>
 //#include "dfa.h"
 using namespace std;
 
@@ -83,45 +87,221 @@ start A-Z a-z ID
 ID a-z A-Z 0-9 ID
 )";
 
+// States are numbered as the spec lists them while it is read. minimize()
+// then drops unreachable states, merges equivalent ones with Hopcroft's
+// algorithm and splits the characters into classes that every state treats
+// alike, so the scanning table is states x classes rather than states x 128.
+// Accepting states are never merged with each other: their names are the
+// token kinds.
 class DFA{
-    vector<pair<string, bool>> states;
-    vector<pair<string, pair<char,string>>> transitions; 
+    unordered_map<string, int> ids;
+    vector<string> names;
+    vector<bool> accepting;
+    vector<array<int, 128>> delta;  // as read, -1 for no transition
+    int classes = 0;
+    unsigned char classOf[256];
+    vector<int> table;              // state * classes + class, -1 for none
+
+    vector<int> characterClasses(const vector<array<int, 128>> &d, int &count);
 
     public:
-    pair<string,bool> initial;
-    bool getAccept(string s){ 
-        for(auto n : states){
-            if(n.first == s) return n.second;
-        }
-        throw runtime_error("Invalid state!");
+    int initial = 0;
+    int specStates = 0;
+    bool getAccept(int s) const { return accepting[s]; }
+    const string &name(int s) const { return names[s]; }
+    int size() const { return names.size(); }
+    int classCount() const { return classes; }
+    int state(const string &s) const {
+      auto it = ids.find(s);
+      if (it == ids.end()) throw runtime_error("Invalid state!");
+      return it->second;
     }
     void addState(string s, bool accept){
-        states.push_back(make_pair(s,accept));
+      if (!ids.emplace(s, names.size()).second) throw runtime_error("Duplicate state " + s);
+      names.push_back(s);
+      accepting.push_back(accept);
+      array<int, 128> none;
+      none.fill(-1);
+      delta.push_back(none);
     }
-    void addTransition(string s1, char c, string s2){ 
-        bool check1 = false;
-        bool check2 = false;
-        for(auto n: states){
-            if (n.first == s1) check1 = true;
-            if (n.first == s2) check2 = true;
-        }
-        if (!(check1 && check2)) throw runtime_error("Invalid state!");
-        transitions.push_back(make_pair(s1,make_pair(c,s2)));
+    // The first transition listed for a state and character wins.
+    void addTransition(int s1, char c, int s2){
+      int &t = delta[s1][(unsigned char)c];
+      if (t < 0) t = s2;
     }
-    string getNextState(string s, char c){ 
-        bool check = false;
-        for(auto n: transitions){
-            if (n.first == s){
-                    if (n.second.first == c){
-                        check = true;
-                        return n.second.second;
-                    }
-            }
-        }
-        if (!(check)) return "novalidstate";
+    void minimize();
+    int getNextState(int s, char c) const {
+      return table[s * classes + classOf[(unsigned char)c]];
     }
 };
 
+// Classes of characters with identical columns in d; returns each
+// character's class (characters above 127 have no transitions).
+vector<int> DFA::characterClasses(const vector<array<int, 128>> &d, int &count) {
+  map<vector<int>, int> columns;
+  vector<int> cls(256);
+  vector<int> column(d.size());
+  for (int c = 0; c < 256; ++c) {
+    for (size_t s = 0; s < d.size(); ++s) column[s] = c < 128 ? d[s][c] : -1;
+    cls[c] = columns.emplace(column, columns.size()).first->second;
+  }
+  count = columns.size();
+  return cls;
+}
+
+void DFA::minimize() {
+  specStates = names.size();
+  // Reachable states, renumbered in breadth-first order from the start.
+  vector<int> order(1, initial), renumber(names.size(), -1);
+  renumber[initial] = 0;
+  for (size_t i = 0; i < order.size(); ++i) {
+    for (int t : delta[order[i]]) {
+      if (t >= 0 && renumber[t] < 0) {
+        renumber[t] = order.size();
+        order.push_back(t);
+      }
+    }
+  }
+  int n = order.size();
+  int dead = n;  // stands for every missing transition
+  int k;
+  vector<int> cls = characterClasses(delta, k);
+  vector<int> rep(k);
+  for (int c = 127; c >= 0; --c) rep[cls[c]] = c;
+  // next[s * k + a] over states 0..n, the dead state included.
+  vector<int> next((n + 1) * k, dead);
+  for (int s = 0; s < n; ++s) {
+    for (int a = 0; a < k; ++a) {
+      int t = rep[a] < 128 ? delta[order[s]][rep[a]] : -1;
+      if (t >= 0) next[s * k + a] = renumber[t];
+    }
+  }
+  // Predecessors by class, as offsets into one array.
+  vector<int> predStart((n + 1) * k + 1, 0), pred((n + 1) * k);
+  for (int s = 0; s <= n; ++s) {
+    for (int a = 0; a < k; ++a) ++predStart[next[s * k + a] * k + a + 1];
+  }
+  for (size_t i = 1; i < predStart.size(); ++i) predStart[i] += predStart[i - 1];
+  {
+    vector<int> fill(predStart.begin(), predStart.end() - 1);
+    for (int s = 0; s <= n; ++s) {
+      for (int a = 0; a < k; ++a) pred[fill[next[s * k + a] * k + a]++] = s;
+    }
+  }
+  // Refinable partition: block b holds elems[first[b] .. end[b]), the
+  // marked ones at the front.
+  vector<int> elems(n + 1), loc(n + 1), blockOf(n + 1);
+  vector<int> first, end, marked;
+  int pos = 0;
+  auto newBlock = [&](const vector<int> &members) {
+    int b = first.size();
+    first.push_back(pos);
+    for (int s : members) {
+      elems[pos] = s;
+      loc[s] = pos++;
+      blockOf[s] = b;
+    }
+    end.push_back(pos);
+    marked.push_back(0);
+  };
+  // The dead state starts in a block of its own: a rejecting state that
+  // still has transitions keeps consuming input under maximal munch, even
+  // if it can never reach acceptance, so it must not become missing.
+  vector<int> rejecting;
+  for (int s = 0; s < n; ++s) if (!accepting[order[s]]) rejecting.push_back(s);
+  newBlock(rejecting);
+  newBlock(vector<int>(1, dead));
+  for (int s = 0; s < n; ++s) if (accepting[order[s]]) newBlock(vector<int>(1, s));
+  // Worklist of (block, class) splitters.
+  vector<char> waiting((n + 1) * k, 0);
+  vector<pair<int, int>> work;
+  for (int b = 1; b < (int)first.size(); ++b) {
+    for (int a = 0; a < k; ++a) {
+      waiting[b * k + a] = 1;
+      work.push_back(make_pair(b, a));
+    }
+  }
+  vector<int> touched, splitter;
+  while (!work.empty()) {
+    int b = work.back().first, a = work.back().second;
+    work.pop_back();
+    waiting[b * k + a] = 0;
+    splitter.assign(elems.begin() + first[b], elems.begin() + end[b]);
+    for (int t : splitter) {
+      for (int i = predStart[t * k + a]; i < predStart[t * k + a + 1]; ++i) {
+        int s = pred[i], y = blockOf[s];
+        int j = first[y] + marked[y];
+        if (loc[s] < j) continue;  // already marked
+        if (marked[y]++ == 0) touched.push_back(y);
+        int other = elems[j];
+        swap(elems[loc[s]], elems[j]);
+        loc[other] = loc[s];
+        loc[s] = j;
+      }
+    }
+    for (int y : touched) {
+      int m = marked[y];
+      marked[y] = 0;
+      if (m == end[y] - first[y]) continue;
+      // The marked front of y becomes a new block.
+      int z = first.size();
+      first.push_back(first[y]);
+      end.push_back(first[y] + m);
+      marked.push_back(0);
+      first[y] += m;
+      for (int i = first[z]; i < end[z]; ++i) blockOf[elems[i]] = z;
+      for (int c = 0; c < k; ++c) {
+        if (waiting[y * k + c] || m <= end[y] - first[y]) {
+          waiting[z * k + c] = 1;
+          work.push_back(make_pair(z, c));
+        } else {
+          waiting[y * k + c] = 1;
+          work.push_back(make_pair(y, c));
+        }
+      }
+    }
+    touched.clear();
+  }
+  // One state per block but the dead state's, numbered from the start.
+  int blocks = first.size();
+  vector<int> number(blocks, -1), members;
+  number[blockOf[0]] = 0;
+  members.push_back(0);
+  for (size_t i = 0; i < members.size(); ++i) {
+    for (int a = 0; a < k; ++a) {
+      int t = next[members[i] * k + a], b = blockOf[t];
+      if (b != blockOf[dead] && number[b] < 0) {
+        number[b] = members.size();
+        members.push_back(t);
+      }
+    }
+  }
+  vector<string> minNames;
+  vector<bool> minAccepting;
+  vector<array<int, 128>> minDelta(members.size());
+  for (size_t i = 0; i < members.size(); ++i) {
+    int s = members[i];
+    minNames.push_back(names[order[s]]);
+    minAccepting.push_back(accepting[order[s]]);
+    for (int c = 0; c < 128; ++c) {
+      int b = blockOf[next[s * k + cls[c]]];
+      minDelta[i][c] = b == blockOf[dead] ? -1 : number[b];
+    }
+  }
+  names.swap(minNames);
+  accepting.swap(minAccepting);
+  ids.clear();
+  initial = 0;
+  // Merged states may now treat more characters alike.
+  cls = characterClasses(minDelta, classes);
+  for (int c = 0; c < 256; ++c) classOf[c] = cls[c];
+  table.assign(names.size() * classes, -1);
+  for (size_t s = 0; s < names.size(); ++s) {
+    for (int c = 0; c < 128; ++c) table[s * classes + classOf[c]] = minDelta[s][c];
+  }
+  delta.clear();
+}
+
 //Helper Functions
 
 bool isChar(string s) {
@@ -233,7 +413,13 @@ string unescape(string s) {
   return p;
 }
 
-void check_restrict(string state, string token){
+string position(int line, size_t start) {
+  if (line == 0) return "";
+  return " " + to_string(line) + ":" + to_string(start + 1);
+}
+
+// where is empty, or " line:column" with -pos.
+void check_restrict(string state, string token, const string &where){
   if (state == "?WHITESPACE" || state == "?COMMENT") return;
   else if (state == "NUM"){
     signed long int d = stoul(token);
@@ -256,33 +442,28 @@ void check_restrict(string state, string token){
     else if (token == "delete") state = "DELETE";
     else if (token == "NULL") state = "NULL";
   }
-  cout << state << " " << token << endl;
+  cout << state << " " << token << where << endl;
 }
 
-void maxmunch(string s, DFA &dfa){ 
-  string state = dfa.initial.first;
-  string token = "";
+// line is the line number to tag tokens with, or 0 for none.
+void maxmunch(const string &s, const DFA &dfa, int line){ 
+  int state = dfa.initial;
+  size_t start = 0;
 
-  while(s.length() > 0){
-    char c = s.front(); 
-    string next = dfa.getNextState(state, c);
-    if (next != "novalidstate"){
-      token += c; 
-      s.erase(0,1);
+  for (size_t i = 0; i < s.length(); ) {
+    int next = dfa.getNextState(state, s[i]);
+    if (next >= 0){
       state = next;
+      ++i;
+    } else if (dfa.getAccept(state) && i > start) {
+      check_restrict(dfa.name(state), s.substr(start, i - start), position(line, start));
+      state = dfa.initial;
+      start = i;
     } else {
-      if (dfa.getAccept(state)) {
-        check_restrict(state, token);
-        state = dfa.initial.first;
-        token = "";
-      }
-      else {
-        throw runtime_error("invalid transition state");
-        return;
-      } 
+      throw runtime_error("invalid transition state");
     }
   }
-  if (dfa.getAccept(state)) check_restrict(state, token);
+  if (dfa.getAccept(state)) check_restrict(dfa.name(state), s.substr(start), position(line, start));
   else throw runtime_error("end of input not accepted");
 }
 
@@ -322,7 +503,7 @@ DFA DFAconstruct(istream &in) {
     }
 
     dfa.addState(s, accepting);
-    if (first) dfa.initial = make_pair(s, accepting);
+    if (first) dfa.initial = dfa.size() - 1;
     first = false;
   }
   // Get transitions
@@ -349,10 +530,9 @@ DFA DFAconstruct(istream &in) {
         ("Incomplete transition line: " + lineStr);
     }
     // Extract state information from the line
-    string fromState = lineVec.front();
-    string toState = lineVec.back();
+    int fromState = dfa.state(lineVec.front());
+    int toState = dfa.state(lineVec.back());
     // Extract character and range information from the line
-    vector<char> charVec;
     for(int i = 1; i < lineVec.size()-1; ++i) {
       string charOrRange = escape(lineVec[i]);
       if (isChar(charOrRange)) {
@@ -362,10 +542,15 @@ DFA DFAconstruct(istream &in) {
             ("Invalid (non-ASCII) character in transition line: " + lineStr + "\n"
              + "Character " + unescape(string(1,c)) + " is outside ASCII range");
         }
-        charVec.push_back(c);
+        dfa.addTransition(fromState, c, toState);
       } else if (isRange(charOrRange)) {
-        for(char c = charOrRange[0]; charOrRange[0] <= c && c <= charOrRange[2]; ++c) {
-          charVec.push_back(c);
+        int lo = (unsigned char)charOrRange[0], hi = (unsigned char)charOrRange[2];
+        if (lo > 127 || hi > 127) {
+          throw runtime_error
+            ("Invalid (non-ASCII) range in transition line: " + lineStr);
+        }
+        for(int c = lo; c <= hi; ++c) {
+          dfa.addTransition(fromState, c, toState);
         }
       } else {
         throw runtime_error
@@ -373,21 +558,34 @@ DFA DFAconstruct(istream &in) {
            + charOrRange + " in transition line: " + lineStr);
       }
     }
-    for ( char c : charVec ) {
-        dfa.addTransition(fromState, c, toState); 
-    }
   }
+  dfa.minimize();
   return dfa;
 }
 
-int main(){
+int main(int argc, char *argv[]){
   try {
+    bool stats = false;
+    bool positions = false;
+    for (int i = 1; i < argc; ++i) {
+      if (string(argv[i]) == "-stats") stats = true;
+      else if (string(argv[i]) == "-pos") positions = true;
+      else throw runtime_error("usage: wlp4scanner [-stats] [-pos] < input");
+    }
+    auto start = chrono::steady_clock::now();
     stringstream s(DFAstring);
     DFA dfa = DFAconstruct(s);
+    if (stats) {
+      double ms = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+      cerr << "DFA: " << dfa.specStates << " states, " << dfa.size() << " after minimization, "
+           << dfa.classCount() << " character classes, built in " << ms << " ms" << endl;
+    }
     string input;
+    int line = 0;
     while(getline(cin, input)){
+      ++line;
       if (input.size() == 0) continue;
-      maxmunch(input, dfa);
+      maxmunch(input, dfa, positions ? line : 0);
     }
   } catch(runtime_error &e) {
     cerr << "ERROR: " << e.what() << "\n";
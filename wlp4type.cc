@@ -0,0 +1,582 @@
+#include <iostream>
+#include <string>
+#include <vector>
+#include <utility>
+#include <sstream>
+#include <cstdint>
+#include <chrono>
+#include <unordered_map>
+#include <cctype>
+#include <stdexcept>
+using namespace std;
+
+// Semantic analysis for WLP4. Reads the parse tree printed by wlp4parser,
+// checks declarations, calls and types, and writes the same tree with
+// " : int" or " : int*" after every expr, term, factor and lvalue and
+// every NUM, NULL and variable ID, so it fits between wlp4parser and
+// wlp4gen:
+//   wlp4scanner < prog.wlp4 | wlp4parser | wlp4type | wlp4gen > prog.asm
+// Identifiers are interned once into dense ids. Procedures live in a flat
+// open-addressing table keyed by id; variables live in a table indexed by
+// id whose entries are stamped with the procedure that declared them, so
+// each procedure starts with an empty local table at no cost. The tree is
+// kept as a flat preorder array and walked once with an explicit stack;
+// every lookup is O(1), so the whole pass is linear in the size of the
+// tree.
+
+enum Type { NONE, INT, PTR };
+
+const char *typeName(Type t) {
+  return t == PTR ? "int*" : "int";
+}
+
+enum Rule {
+  TOKEN,
+  START, PROCEDURES_MORE, PROCEDURES_MAIN, PROCEDURE, MAIN,
+  PARAMS_NONE, PARAMS, PARAMLIST_ONE, PARAMLIST_MORE,
+  TYPE_INT, TYPE_PTR, DCLS_NONE, DCLS_NUM, DCLS_NULL, DCL,
+  STATEMENTS_NONE, STATEMENTS_MORE, ASSIGN, IF, WHILE, PRINTLN, DELETE, TEST,
+  EXPR_TERM, EXPR_PLUS, EXPR_MINUS, TERM_FACTOR, TERM_MUL,
+  FACTOR_ID, FACTOR_NUM, FACTOR_NULL, FACTOR_PAREN, FACTOR_AMP, FACTOR_STAR,
+  FACTOR_NEW, FACTOR_CALL0, FACTOR_CALL, ARGLIST_ONE, ARGLIST_MORE,
+  LVALUE_ID, LVALUE_STAR, LVALUE_PAREN
+};
+
+const unordered_map<string, Rule> RULES = {
+  {"start BOF procedures EOF", START},
+  {"procedures procedure procedures", PROCEDURES_MORE},
+  {"procedures main", PROCEDURES_MAIN},
+  {"procedure INT ID LPAREN params RPAREN LBRACE dcls statements RETURN expr SEMI RBRACE", PROCEDURE},
+  {"main INT WAIN LPAREN dcl COMMA dcl RPAREN LBRACE dcls statements RETURN expr SEMI RBRACE", MAIN},
+  {"params", PARAMS_NONE},
+  {"params paramlist", PARAMS},
+  {"paramlist dcl", PARAMLIST_ONE},
+  {"paramlist dcl COMMA paramlist", PARAMLIST_MORE},
+  {"type INT", TYPE_INT},
+  {"type INT STAR", TYPE_PTR},
+  {"dcls", DCLS_NONE},
+  {"dcls dcls dcl BECOMES NUM SEMI", DCLS_NUM},
+  {"dcls dcls dcl BECOMES NULL SEMI", DCLS_NULL},
+  {"dcl type ID", DCL},
+  {"statements", STATEMENTS_NONE},
+  {"statements statements statement", STATEMENTS_MORE},
+  {"statement lvalue BECOMES expr SEMI", ASSIGN},
+  {"statement IF LPAREN test RPAREN LBRACE statements RBRACE ELSE LBRACE statements RBRACE", IF},
+  {"statement WHILE LPAREN test RPAREN LBRACE statements RBRACE", WHILE},
+  {"statement PRINTLN LPAREN expr RPAREN SEMI", PRINTLN},
+  {"statement DELETE LBRACK RBRACK expr SEMI", DELETE},
+  {"test expr EQ expr", TEST},
+  {"test expr NE expr", TEST},
+  {"test expr LT expr", TEST},
+  {"test expr LE expr", TEST},
+  {"test expr GE expr", TEST},
+  {"test expr GT expr", TEST},
+  {"expr term", EXPR_TERM},
+  {"expr expr PLUS term", EXPR_PLUS},
+  {"expr expr MINUS term", EXPR_MINUS},
+  {"term factor", TERM_FACTOR},
+  {"term term STAR factor", TERM_MUL},
+  {"term term SLASH factor", TERM_MUL},
+  {"term term PCT factor", TERM_MUL},
+  {"factor ID", FACTOR_ID},
+  {"factor NUM", FACTOR_NUM},
+  {"factor NULL", FACTOR_NULL},
+  {"factor LPAREN expr RPAREN", FACTOR_PAREN},
+  {"factor AMP lvalue", FACTOR_AMP},
+  {"factor STAR factor", FACTOR_STAR},
+  {"factor NEW INT LBRACK expr RBRACK", FACTOR_NEW},
+  {"factor ID LPAREN RPAREN", FACTOR_CALL0},
+  {"factor ID LPAREN arglist RPAREN", FACTOR_CALL},
+  {"arglist expr", ARGLIST_ONE},
+  {"arglist expr COMMA arglist", ARGLIST_MORE},
+  {"lvalue ID", LVALUE_ID},
+  {"lvalue STAR factor", LVALUE_STAR},
+  {"lvalue LPAREN lvalue RPAREN", LVALUE_PAREN},
+};
+
+bool typedRule(Rule r) {
+  return r >= EXPR_TERM;
+}
+
+uint32_t fnv1a(const string &s) {
+  uint32_t h = 2166136261u;
+  for (unsigned char c : s) h = (h ^ c) * 16777619u;
+  return h;
+}
+
+// Maps each distinct identifier to a dense id, 0, 1, 2, ... Open
+// addressing with linear probing, kept at most half full.
+class Interner {
+    vector<string> names;
+    vector<int> slots;  // id + 1, or 0 when empty
+
+    void grow() {
+      vector<int> old(slots.size() * 2, 0);
+      swap(slots, old);
+      size_t mask = slots.size() - 1;
+      for (int s : old) {
+        if (!s) continue;
+        size_t i = fnv1a(names[s - 1]) & mask;
+        while (slots[i]) i = (i + 1) & mask;
+        slots[i] = s;
+      }
+    }
+
+    public:
+    Interner() : slots(1024, 0) {}
+    int intern(const string &s) {
+      size_t mask = slots.size() - 1;
+      size_t i = fnv1a(s) & mask;
+      for (; slots[i]; i = (i + 1) & mask) {
+        if (names[slots[i] - 1] == s) return slots[i] - 1;
+      }
+      names.push_back(s);
+      slots[i] = names.size();
+      if (names.size() * 2 > slots.size()) grow();
+      return names.size() - 1;
+    }
+    const string &name(int id) const { return names[id]; }
+    int size() const { return names.size(); }
+};
+
+class Proc {
+  public:
+  int name;            // identifier id
+  vector<Type> params;
+};
+
+// Procedures by identifier id: open addressing with linear probing over
+// a power-of-two array of (id, index into procs) pairs, at most half full.
+class ProcTable {
+    vector<pair<int, int>> slots;  // id -1 when empty
+
+    size_t home(int id) const {
+      return ((uint32_t)id * 2654435769u) & (slots.size() - 1);
+    }
+    void grow() {
+      vector<pair<int, int>> old(slots.size() * 2, make_pair(-1, -1));
+      swap(slots, old);
+      for (auto &s : old) if (s.first >= 0) place(s.first, s.second);
+    }
+    void place(int id, int index) {
+      size_t i = home(id);
+      while (slots[i].first >= 0) i = (i + 1) & (slots.size() - 1);
+      slots[i] = make_pair(id, index);
+    }
+
+    public:
+    vector<Proc> procs;
+
+    ProcTable() : slots(256, make_pair(-1, -1)) {}
+    // -1 if id does not name a procedure.
+    int find(int id) const {
+      for (size_t i = home(id); slots[i].first >= 0; i = (i + 1) & (slots.size() - 1)) {
+        if (slots[i].first == id) return slots[i].second;
+      }
+      return -1;
+    }
+    // False if a procedure with that name already exists.
+    bool add(int id) {
+      if (find(id) >= 0) return false;
+      procs.push_back(Proc());
+      procs.back().name = id;
+      place(id, procs.size() - 1);
+      if (procs.size() * 2 > slots.size()) grow();
+      return true;
+    }
+};
+
+// One line of the parse tree. Nodes are stored in preorder, so a node's
+// first child is the next node and its subtree ends at end.
+class Node {
+  public:
+  string line;   // as read, without trailing blanks
+  Rule rule;
+  bool leaf;
+  int ident;     // interned lexeme of an ID token, else -1
+  int end;       // one past the last node of the subtree
+  int next;      // next sibling, or -1
+  Type type;
+};
+
+class Tree {
+  public:
+  vector<Node> nodes;
+
+  // Index of the k-th child of n.
+  int child(int n, int k) const {
+    int c = n + 1;
+    while (k--) c = nodes[c].next;
+    return c;
+  }
+};
+
+Tree readTree(istream &in, Interner &ids) {
+  Tree tree;
+  vector<pair<int, int>> pending;  // node, children still to read
+  vector<string> words;
+  string line;
+  do {
+    if (!getline(in, line)) throw runtime_error("unexpected end of parse tree");
+    line.erase(line.find_last_not_of(" \t\r") + 1);
+    int n = tree.nodes.size();
+    tree.nodes.push_back(Node());
+    Node &node = tree.nodes.back();
+    node.ident = -1;
+    node.next = -1;
+    node.type = NONE;
+    // Split on blanks by hand: this loop runs once per node.
+    words.clear();
+    for (size_t i = 0; i < line.size();) {
+      size_t j = line.find(' ', i);
+      if (j == string::npos) j = line.size();
+      if (j > i) words.push_back(line.substr(i, j - i));
+      i = j + 1;
+    }
+    if (words.empty()) throw runtime_error("empty line in parse tree");
+    int expect = 0;
+    node.leaf = isupper(words[0][0]);
+    if (node.leaf) {
+      node.rule = TOKEN;
+      if (words[0] == "ID" && words.size() > 1) node.ident = ids.intern(words[1]);
+    } else {
+      string rule = words[0];
+      for (size_t i = 1; i < words.size() && words[i] != ":"; ++i) {
+        if (words[i] == ".EMPTY") continue;
+        rule += ' ';
+        rule += words[i];
+        ++expect;
+      }
+      auto r = RULES.find(rule);
+      if (r == RULES.end()) throw runtime_error("unknown rule " + rule);
+      node.rule = r->second;
+    }
+    node.line = move(line);
+    if (!pending.empty()) {
+      int parent = pending.back().first;
+      int prev = tree.nodes[parent].end;  // last child read so far
+      if (prev > parent) tree.nodes[prev].next = n;
+      tree.nodes[parent].end = n;
+      --pending.back().second;
+    }
+    tree.nodes[n].end = expect > 0 ? n : n + 1;
+    if (expect > 0) pending.push_back(make_pair(n, expect));
+    while (!pending.empty() && pending.back().second == 0) {
+      // end held the last child; it becomes one past the subtree.
+      int p = pending.back().first;
+      tree.nodes[p].end = tree.nodes[tree.nodes[p].end].end;
+      pending.pop_back();
+    }
+  } while (!pending.empty());
+  return tree;
+}
+
+void writeTree(ostream &out, const Tree &tree) {
+  for (const Node &n : tree.nodes) {
+    out << n.line;
+    if (n.type != NONE && (typedRule(n.rule) || n.leaf)) out << " : " << typeName(n.type);
+    out << "\n";
+  }
+}
+
+class Checker {
+    Tree &tree;
+    Interner &ids;
+    ProcTable table;
+    vector<int> stamp;     // procedure number that declared each id, -1 if none
+    vector<Type> varType;
+    int current;           // procedure number being checked
+    int proc;              // its index in table.procs
+
+    Node &node(int n) { return tree.nodes[n]; }
+    Type type(int n) { return tree.nodes[n].type; }
+    int child(int n, int k) { return tree.child(n, k); }
+    void fail(const string &msg) {
+      throw runtime_error("in " + ids.name(table.procs[proc].name) + ": " + msg);
+    }
+    void expect(int n, Type t, const string &what) {
+      if (type(n) != t) fail(what + " must be " + typeName(t) + ", not " + typeName(type(n)));
+    }
+    bool declared(int id) {
+      return id < (int)stamp.size() && stamp[id] == current;
+    }
+    Type variable(int id) {
+      if (!declared(id)) fail("undeclared variable " + ids.name(id));
+      return varType[id];
+    }
+
+    void enter(int n);
+    void leave(int n);
+    void call(int n);
+
+    public:
+    Checker(Tree &t, Interner &i) : tree(t), ids(i), current(-1), proc(-1) {}
+    void run();
+};
+
+void Checker::enter(int n) {
+  Rule r = node(n).rule;
+  if (r != PROCEDURE && r != MAIN) return;
+  int id = node(child(n, 1)).ident;
+  if (r == MAIN) id = ids.intern("wain");
+  if (!table.add(id)) {
+    throw runtime_error("duplicate procedure " + ids.name(id));
+  }
+  ++current;
+  proc = table.procs.size() - 1;
+  if (stamp.size() < (size_t)ids.size()) {
+    stamp.resize(ids.size(), -1);
+    varType.resize(ids.size(), NONE);
+  }
+}
+
+void Checker::call(int n) {
+  int id = node(child(n, 0)).ident;
+  if (declared(id)) fail(ids.name(id) + " is a variable, not a procedure");
+  int p = table.find(id);
+  if (p < 0) fail("undeclared procedure " + ids.name(id));
+  const vector<Type> &params = table.procs[p].params;
+  size_t k = 0;
+  if (node(n).rule == FACTOR_CALL) {
+    for (int a = child(n, 2);; a = child(a, 2)) {
+      int arg = child(a, 0);
+      if (k < params.size() && type(arg) != params[k]) {
+        fail("argument " + to_string(k + 1) + " of " + ids.name(id) + " must be " +
+             typeName(params[k]) + ", not " + typeName(type(arg)));
+      }
+      ++k;
+      if (node(a).rule == ARGLIST_ONE) break;
+    }
+  }
+  if (k != params.size()) {
+    fail("wrong number of arguments to " + ids.name(id) + ": expected " + to_string(params.size()) +
+         ", got " + to_string(k));
+  }
+  node(n).type = INT;
+}
+
+void Checker::leave(int n) {
+  Node &t = node(n);
+  switch (t.rule) {
+    case DCL: {
+      Type ty = node(child(n, 0)).rule == TYPE_PTR ? PTR : INT;
+      int idNode = child(n, 1);
+      int id = node(idNode).ident;
+      if (declared(id)) fail("duplicate declaration of " + ids.name(id));
+      stamp[id] = current;
+      varType[id] = ty;
+      t.type = node(idNode).type = ty;
+      break;
+    }
+    case PARAMS:
+      for (int l = child(n, 0);; l = child(l, 2)) {
+        table.procs[proc].params.push_back(type(child(l, 0)));
+        if (node(l).rule == PARAMLIST_ONE) break;
+      }
+      break;
+    case DCLS_NUM:
+      expect(child(n, 1), INT, "a variable initialized with a number");
+      node(child(n, 3)).type = INT;
+      break;
+    case DCLS_NULL:
+      expect(child(n, 1), PTR, "a variable initialized with NULL");
+      node(child(n, 3)).type = PTR;
+      break;
+    case PROCEDURE:
+      expect(child(n, 9), INT, "the return value");
+      break;
+    case MAIN:
+      expect(child(n, 5), INT, "the second parameter of wain");
+      expect(child(n, 11), INT, "the return value");
+      break;
+    case ASSIGN:
+      if (type(child(n, 0)) != type(child(n, 2))) {
+        fail(string("cannot assign ") + typeName(type(child(n, 2))) + " to " + typeName(type(child(n, 0))));
+      }
+      break;
+    case PRINTLN:
+      expect(child(n, 2), INT, "the argument of println");
+      break;
+    case DELETE:
+      expect(child(n, 3), PTR, "the argument of delete");
+      break;
+    case TEST:
+      if (type(child(n, 0)) != type(child(n, 2))) {
+        fail(string("cannot compare ") + typeName(type(child(n, 0))) + " with " + typeName(type(child(n, 2))));
+      }
+      break;
+    case EXPR_TERM:
+    case TERM_FACTOR:
+      t.type = type(n + 1);
+      break;
+    case EXPR_PLUS: {
+      Type a = type(child(n, 0)), b = type(child(n, 2));
+      if (a == PTR && b == PTR) fail("cannot add int* to int*");
+      t.type = a == PTR || b == PTR ? PTR : INT;
+      break;
+    }
+    case EXPR_MINUS: {
+      Type a = type(child(n, 0)), b = type(child(n, 2));
+      if (a == INT && b == PTR) fail("cannot subtract int* from int");
+      t.type = a == b ? INT : PTR;
+      break;
+    }
+    case TERM_MUL:
+      expect(child(n, 0), INT, "an operand of *, / or %");
+      expect(child(n, 2), INT, "an operand of *, / or %");
+      t.type = INT;
+      break;
+    case FACTOR_ID:
+    case LVALUE_ID:
+      t.type = node(n + 1).type = variable(node(n + 1).ident);
+      break;
+    case FACTOR_NUM:
+      t.type = node(n + 1).type = INT;
+      break;
+    case FACTOR_NULL:
+      t.type = node(n + 1).type = PTR;
+      break;
+    case FACTOR_PAREN:
+    case LVALUE_PAREN:
+      t.type = type(child(n, 1));
+      break;
+    case FACTOR_AMP:
+      expect(child(n, 1), INT, "the operand of &");
+      t.type = PTR;
+      break;
+    case FACTOR_STAR:
+    case LVALUE_STAR:
+      expect(child(n, 1), PTR, "the operand of *");
+      t.type = INT;
+      break;
+    case FACTOR_NEW:
+      expect(child(n, 3), INT, "the size in new");
+      t.type = PTR;
+      break;
+    case FACTOR_CALL0:
+    case FACTOR_CALL:
+      call(n);
+      break;
+    default:
+      break;
+  }
+}
+
+// Preorder walk: a node is entered when reached and left once every node
+// of its subtree has been, so children are typed before their parent and
+// declarations are seen before the statements that use them.
+void Checker::run() {
+  vector<int> open;
+  int size = tree.nodes.size();
+  for (int n = 0; n < size; ++n) {
+    while (!open.empty() && node(open.back()).end <= n) {
+      leave(open.back());
+      open.pop_back();
+    }
+    enter(n);
+    open.push_back(n);
+  }
+  while (!open.empty()) {
+    leave(open.back());
+    open.pop_back();
+  }
+}
+
+// A parse tree with procs procedures, each taking an int and an int*,
+// declaring vars locals and running stmts assignments, every tenth of
+// which calls the previous procedure.
+string benchTree(int procs, int vars, int stmts) {
+  ostringstream out;
+  auto var = [&](const string &name) {
+    out << "expr term\nterm factor\nfactor ID\nID " << name << "\n";
+  };
+  auto dcl = [&](const string &name, bool ptr) {
+    out << "dcl type ID\n" << (ptr ? "type INT STAR\nINT int\nSTAR *\n" : "type INT\nINT int\n")
+        << "ID " << name << "\n";
+  };
+  out << "start BOF procedures EOF\nBOF BOF\n";
+  for (int k = 0; k < procs; ++k) {
+    string name = "p" + to_string(k), callee = "p" + to_string(k ? k - 1 : 0);
+    out << "procedures procedure procedures\n"
+        << "procedure INT ID LPAREN params RPAREN LBRACE dcls statements RETURN expr SEMI RBRACE\n"
+        << "INT int\nID " << name << "\nLPAREN (\nparams paramlist\nparamlist dcl COMMA paramlist\n";
+    dcl("a", false);
+    out << "COMMA ,\nparamlist dcl\n";
+    dcl("b", true);
+    out << "RPAREN )\nLBRACE {\n";
+    for (int i = 0; i < vars; ++i) out << "dcls dcls dcl BECOMES NUM SEMI\n";
+    out << "dcls .EMPTY\n";
+    for (int i = 0; i < vars; ++i) {
+      dcl("v" + to_string(i), false);
+      out << "BECOMES =\nNUM " << i << "\nSEMI ;\n";
+    }
+    for (int i = 0; i < stmts; ++i) out << "statements statements statement\n";
+    out << "statements .EMPTY\n";
+    for (int i = 0; i < stmts; ++i) {
+      string dst = "v" + to_string(i % vars), src = "v" + to_string((i * 7 + 3) % vars);
+      out << "statement lvalue BECOMES expr SEMI\nlvalue ID\nID " << dst << "\nBECOMES =\n";
+      if (i % 10 == 9) {
+        out << "expr term\nterm factor\nfactor ID LPAREN arglist RPAREN\nID " << callee
+            << "\nLPAREN (\narglist expr COMMA arglist\n";
+        var(src);
+        out << "COMMA ,\narglist expr\n";
+        var("b");
+        out << "RPAREN )\n";
+      } else {
+        out << "expr expr PLUS term\n";
+        var(src);
+        out << "PLUS +\nterm term STAR factor\nterm factor\nfactor ID\nID a\nSTAR *\nfactor NUM\nNUM 2\n";
+      }
+      out << "SEMI ;\n";
+    }
+    out << "RETURN return\n";
+    var("v0");
+    out << "SEMI ;\nRBRACE }\n";
+  }
+  out << "procedures main\n"
+      << "main INT WAIN LPAREN dcl COMMA dcl RPAREN LBRACE dcls statements RETURN expr SEMI RBRACE\n"
+      << "INT int\nWAIN wain\nLPAREN (\n";
+  dcl("a", false);
+  out << "COMMA ,\n";
+  dcl("b", false);
+  out << "RPAREN )\nLBRACE {\ndcls .EMPTY\nstatements .EMPTY\nRETURN return\n";
+  var("a");
+  out << "SEMI ;\nRBRACE }\nEOF EOF\n";
+  return out.str();
+}
+
+// Checks synthetic programs of doubling size; time per node should stay
+// flat.
+void bench(int procs) {
+  for (int p = procs; p <= procs * 8; p *= 2) {
+    istringstream in(benchTree(p, 50, 50));
+    Interner ids;
+    auto start = chrono::steady_clock::now();
+    Tree tree = readTree(in, ids);
+    auto read = chrono::steady_clock::now();
+    Checker(tree, ids).run();
+    auto done = chrono::steady_clock::now();
+    double readSecs = chrono::duration<double>(read - start).count();
+    double checkSecs = chrono::duration<double>(done - read).count();
+    cerr << p << " procedures, " << tree.nodes.size() << " nodes: read " << readSecs << " s, checked in "
+         << checkSecs << " s (" << checkSecs / tree.nodes.size() * 1e9 << " ns/node)" << endl;
+  }
+}
+
+int main(int argc, char *argv[]) {
+  try {
+    if (argc > 1 && string(argv[1]) == "-bench") {
+      bench(argc > 2 ? stoi(argv[2]) : 500);
+      return 0;
+    }
+    if (argc > 1) throw runtime_error("usage: wlp4type [-bench [procedures]] < tree");
+    Interner ids;
+    Tree tree = readTree(cin, ids);
+    Checker(tree, ids).run();
+    writeTree(cout, tree);
+  } catch(runtime_error &e) {
+    cerr << "ERROR: " << e.what() << "\n";
+    return 1;
+  }
+  return 0;
+}